@@ -0,0 +1,221 @@
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/IR/Module.h"
+
+#include "bench/IRGen.h"
+
+#include <algorithm>
+#include <vector>
+
+using namespace llvm;
+
+static Function *makeFunction(Module &M, StringRef Name, ArrayRef<Type *> Params) {
+  Type *Void = Type::getVoidTy(M.getContext());
+  return Function::Create(FunctionType::get(Void, Params, false),
+                          GlobalValue::ExternalLinkage, Name, &M);
+}
+
+// About 9 instructions per diamond
+static void buildChain(Module &M, unsigned Size) {
+  LLVMContext &Ctx = M.getContext();
+  IRBuilder<> B(Ctx);
+  Type *I32 = B.getInt32Ty();
+  Function *F = makeFunction(M, "chain$", {I32->getPointerTo(), I32});
+  Value *P = &*F->arg_begin(), *N = &*std::next(F->arg_begin());
+  P->setName("p$");
+  N->setName("n$");
+
+  B.SetInsertPoint(BasicBlock::Create(Ctx, "entry$", F));
+  Value *Acc = B.CreateLoad(I32, P, "acc$");
+  SmallVector<Value *, 64> Live;
+  for (unsigned k = 0, e = std::max(1u, Size / 9); k != e; ++k) {
+    BasicBlock *Then = BasicBlock::Create(Ctx, "then$", F);
+    BasicBlock *Else = BasicBlock::Create(Ctx, "else$", F);
+    BasicBlock *Join = BasicBlock::Create(Ctx, "join$", F);
+    B.CreateCondBr(B.CreateICmpSLT(Acc, B.getInt32(k), "c$"), Then, Else);
+    B.SetInsertPoint(Then);
+    Value *X = B.CreateAdd(Acc, N, "x$");
+    B.CreateBr(Join);
+    B.SetInsertPoint(Else);
+    Value *Y = B.CreateMul(Acc, B.getInt32(3), "y$");
+    B.CreateBr(Join);
+    B.SetInsertPoint(Join);
+    PHINode *Phi = B.CreatePHI(I32, 2, "acc$");
+    Phi->addIncoming(X, Then);
+    Phi->addIncoming(Y, Else);
+    Acc = B.CreateXor(Phi, B.getInt32(k * 2654435761u), "h$");
+    // Live to the end of the chain
+    if (k % 8 == 0)
+      Live.push_back(B.CreateAdd(Acc, N, "live$"));
+  }
+  for (auto v = Live.begin(), e = Live.end(); v != e; ++v)
+    Acc = B.CreateAdd(Acc, *v, "sum$");
+  B.CreateStore(Acc, P);
+  B.CreateRetVoid();
+}
+
+// About 8 instructions per level
+static void buildLoops(Module &M, unsigned Size) {
+  LLVMContext &Ctx = M.getContext();
+  IRBuilder<> B(Ctx);
+  Type *I32 = B.getInt32Ty();
+  Function *F = makeFunction(M, "loops$", {I32->getPointerTo(), I32});
+  Value *P = &*F->arg_begin(), *N = &*std::next(F->arg_begin());
+  P->setName("p$");
+  N->setName("n$");
+
+  BasicBlock *Pre = BasicBlock::Create(Ctx, "entry$", F);
+  B.SetInsertPoint(Pre);
+  Value *Sum = B.getInt32(0);
+  std::vector<PHINode *> IVs;
+  for (unsigned d = 0, e = std::max(1u, Size / 8); d != e; ++d) {
+    BasicBlock *Header = BasicBlock::Create(Ctx, "header$", F);
+    B.CreateBr(Header);
+    B.SetInsertPoint(Header);
+    PHINode *IV = B.CreatePHI(I32, 2, "i$");
+    IV->addIncoming(B.getInt32(0), Pre);
+    IVs.push_back(IV);
+    Sum = B.CreateAdd(Sum, B.CreateMul(IV, B.getInt32(d + 1), "s$"), "sum$");
+    Pre = Header;
+  }
+
+  Value *Addr = B.CreateGEP(I32, P, B.CreateSExt(Sum, B.getInt64Ty(), "idx$"), "addr$");
+  Value *Old = B.CreateLoad(I32, Addr, "old$");
+  B.CreateStore(B.CreateAdd(Old, Sum, "new$"), Addr);
+
+  for (auto iv = IVs.rbegin(), e = IVs.rend(); iv != e; ++iv) {
+    BasicBlock *Latch = BasicBlock::Create(Ctx, "latch$", F);
+    BasicBlock *Exit = BasicBlock::Create(Ctx, "exit$", F);
+    B.CreateBr(Latch);
+    B.SetInsertPoint(Latch);
+    Value *Next = B.CreateAdd(*iv, B.getInt32(1), "i.next$");
+    (*iv)->addIncoming(Next, Latch);
+    B.CreateCondBr(B.CreateICmpSLT(Next, N, "c$"), (*iv)->getParent(), Exit);
+    B.SetInsertPoint(Exit);
+  }
+  B.CreateRetVoid();
+}
+
+// About 4 instructions per value
+static void buildWide(Module &M, unsigned Size) {
+  LLVMContext &Ctx = M.getContext();
+  IRBuilder<> B(Ctx);
+  Type *I32 = B.getInt32Ty();
+  Function *F = makeFunction(M, "wide$", {I32->getPointerTo()});
+  Value *P = &*F->arg_begin();
+  P->setName("p$");
+
+  B.SetInsertPoint(BasicBlock::Create(Ctx, "entry$", F));
+  unsigned N = std::max(2u, Size / 4);
+  std::vector<Value *> Vals, Prods;
+  for (unsigned k = 0; k != N; ++k)
+    Vals.push_back(B.CreateLoad(I32, B.CreateGEP(I32, P, B.getInt64(k), "addr$"), "v$"));
+  for (unsigned k = 0; k != N; ++k)
+    Prods.push_back(B.CreateMul(Vals[k], Vals[(k * 7 + 3) % N], "m$"));
+  while (Prods.size() > 1) {
+    std::vector<Value *> Sums;
+    for (unsigned k = 0; k + 1 < Prods.size(); k += 2)
+      Sums.push_back(B.CreateAdd(Prods[k], Prods[k + 1], "r$"));
+    if (Prods.size() % 2)
+      Sums.push_back(Prods.back());
+    Prods.swap(Sums);
+  }
+  B.CreateStore(Prods[0], P);
+  B.CreateRetVoid();
+}
+
+// About 8 instructions per unit, in blocks of 32 units
+static void buildMemory(Module &M, unsigned Size) {
+  LLVMContext &Ctx = M.getContext();
+  IRBuilder<> B(Ctx);
+  Type *I32 = B.getInt32Ty();
+  Function *F = makeFunction(M, "memory$", {I32->getPointerTo(), I32->getPointerTo()});
+  Value *P = &*F->arg_begin(), *Q = &*std::next(F->arg_begin());
+  P->setName("p$");
+  Q->setName("q$");
+
+  B.SetInsertPoint(BasicBlock::Create(Ctx, "entry$", F));
+  Value *Acc = B.getInt32(0);
+  for (unsigned k = 0, e = std::max(1u, Size / 8); k != e; ++k) {
+    if (k && k % 32 == 0) {
+      BasicBlock *Next = BasicBlock::Create(Ctx, "next$", F);
+      B.CreateBr(Next);
+      B.SetInsertPoint(Next);
+    }
+    Value *PA = B.CreateGEP(I32, P, B.getInt64(k), "pa$");
+    Value *QA = B.CreateGEP(I32, Q, B.getInt64(k), "qa$");
+    Value *A = B.CreateLoad(I32, PA, "a$");
+    Value *C = B.CreateLoad(I32, QA, "b$");
+    Acc = B.CreateAdd(Acc, B.CreateMul(A, C, "m$"), "acc$");
+    B.CreateStore(Acc, B.CreateGEP(I32, P, B.getInt64(k + 1), "pn$"));
+    B.CreateStore(A, QA);
+  }
+  B.CreateRetVoid();
+}
+
+// About 12 instructions per block
+static void buildSReg(Module &M, unsigned Size) {
+  LLVMContext &Ctx = M.getContext();
+  M.setTargetTriple("nvptx64-nvidia-cuda");
+  M.setDataLayout("e-i64:64-i128:128-v16:16-v32:32-n16:32:64");
+  IRBuilder<> B(Ctx);
+  Type *I32 = B.getInt32Ty();
+  Function *F = makeFunction(M, "sreg$", {B.getFloatTy()->getPointerTo(), I32});
+  Value *Out = &*F->arg_begin(), *N = &*std::next(F->arg_begin());
+  Out->setName("out$");
+  N->setName("n$");
+  Metadata *Kernel[] = {ValueAsMetadata::get(F), MDString::get(Ctx, "kernel"),
+                        ConstantAsMetadata::get(B.getInt32(1))};
+  M.getOrInsertNamedMetadata("nvvm.annotations")->addOperand(MDNode::get(Ctx, Kernel));
+
+  Function *Tid = Intrinsic::getDeclaration(&M, Intrinsic::nvvm_read_ptx_sreg_tid_x);
+  Function *TidY = Intrinsic::getDeclaration(&M, Intrinsic::nvvm_read_ptx_sreg_tid_y);
+  Function *NTid = Intrinsic::getDeclaration(&M, Intrinsic::nvvm_read_ptx_sreg_ntid_x);
+  Function *CTAid = Intrinsic::getDeclaration(&M, Intrinsic::nvvm_read_ptx_sreg_ctaid_x);
+
+  B.SetInsertPoint(BasicBlock::Create(Ctx, "entry$", F));
+  BasicBlock *Exit = BasicBlock::Create(Ctx, "exit$", F);
+  for (unsigned k = 0, e = std::max(1u, Size / 12); k != e; ++k) {
+    Value *T = B.CreateCall(Tid, None, "tid$");
+    Value *Y = B.CreateCall(TidY, None, "tid.y$");
+    Value *Block = B.CreateMul(B.CreateCall(CTAid, None, "ctaid$"),
+                               B.CreateCall(NTid, None, "ntid$"), "base$");
+    Value *J = B.CreateAdd(B.CreateAdd(Block, T, "gid$"), B.CreateShl(Y, k % 8, "row$"), "j$");
+    Value *Addr = B.CreateGEP(B.getFloatTy(), Out, B.CreateZExt(J, B.getInt64Ty(), "idx$"), "addr$");
+    B.CreateStore(ConstantFP::get(B.getFloatTy(), k), Addr);
+    BasicBlock *Next = BasicBlock::Create(Ctx, "block$", F);
+    B.CreateCondBr(B.CreateICmpSLT(J, N, "c$"), Next, Exit);
+    B.SetInsertPoint(Next);
+  }
+  B.CreateBr(Exit);
+  B.SetInsertPoint(Exit);
+  B.CreateRetVoid();
+}
+
+const char *bench::getShapeName(Shape S) {
+  switch (S) {
+  case Shape::Chain: return "chain";
+  case Shape::Loops: return "loops";
+  case Shape::Wide: return "wide";
+  case Shape::Memory: return "memory";
+  case Shape::SReg: return "sreg";
+  }
+  llvm_unreachable("unknown shape");
+}
+
+std::unique_ptr<Module> bench::generate(Shape S, unsigned Size, LLVMContext &Ctx) {
+  std::unique_ptr<Module> M(new Module(getShapeName(S), Ctx));
+  switch (S) {
+  case Shape::Chain: buildChain(*M, Size); break;
+  case Shape::Loops: buildLoops(*M, Size); break;
+  case Shape::Wide: buildWide(*M, Size); break;
+  case Shape::Memory: buildMemory(*M, Size); break;
+  case Shape::SReg: buildSReg(*M, Size); break;
+  }
+  return M;
+}
@@ -0,0 +1,31 @@
+#ifndef BENCH_IRGEN_H
+#define BENCH_IRGEN_H
+
+#include <memory>
+
+namespace llvm {
+  class LLVMContext;
+  class Module;
+}
+
+namespace bench {
+  // The kinds of code the benchmark generates, each aimed at a different
+  // part of the passes:
+  //  - Chain: a long chain of if-then-else diamonds whose join blocks are
+  //    all control equivalent, with values kept live across the chain;
+  //  - Loops: a loop nest as deep as the size allows;
+  //  - Wide: one straight-line block of loads, products and a reduction,
+  //    as left by full unrolling;
+  //  - Memory: loads and stores through two pointers that may alias;
+  //  - SReg: an NVPTX kernel reading thread and block ids in every block
+  //    and indexing memory with them.
+  enum class Shape { Chain, Loops, Wide, Memory, SReg };
+
+  const char *getShapeName(Shape S);
+
+  // A module with one function of shape S and roughly Size instructions.
+  // Every name holds a '$', as after the WCode translation.
+  std::unique_ptr<llvm::Module> generate(Shape S, unsigned Size, llvm::LLVMContext &Ctx);
+}
+
+#endif
@@ -0,0 +1,69 @@
+// irgen: writes one of the benchmark modules, to look at it or to run a
+// slow case under opt.
+//
+//   irgen -shape=chain -size=20000 -o chain.bc
+
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/PrettyStackTrace.h"
+#include "llvm/Support/Signals.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "bench/IRGen.h"
+
+#include <memory>
+#include <string>
+
+using namespace llvm;
+using bench::Shape;
+
+static cl::opt<Shape> GenShape("shape", cl::desc("Kind of code to generate"),
+    cl::init(Shape::Chain),
+    cl::values(clEnumValN(Shape::Chain, "chain", "Chain of control-equivalent diamonds"),
+               clEnumValN(Shape::Loops, "loops", "Deep loop nest"),
+               clEnumValN(Shape::Wide, "wide", "Wide straight-line block"),
+               clEnumValN(Shape::Memory, "memory", "Loads and stores through aliasing pointers"),
+               clEnumValN(Shape::SReg, "sreg", "NVPTX kernel reading special registers")));
+
+static cl::opt<unsigned> Size("size", cl::desc("Approximate number of instructions"),
+    cl::init(1000));
+
+static cl::opt<std::string> OutputFilename("o", cl::desc("Output filename"),
+    cl::init("-"), cl::value_desc("filename"));
+
+static cl::opt<bool> OutputAssembly("S", cl::desc("Write output as LLVM assembly"));
+
+int main(int argc, char **argv) {
+  sys::PrintStackTraceOnErrorSignal(argv[0]);
+  PrettyStackTraceProgram X(argc, argv);
+  llvm_shutdown_obj Y;
+
+  cl::ParseCommandLineOptions(argc, argv, "benchmark IR generator\n");
+
+  LLVMContext Context;
+  std::unique_ptr<Module> M = bench::generate(GenShape, Size, Context);
+  if (verifyModule(*M, &errs())) {
+    errs() << argv[0] << ": generated module is broken\n";
+    return 1;
+  }
+
+  std::error_code EC;
+  std::unique_ptr<tool_output_file> Out(new tool_output_file(
+      OutputFilename, EC, OutputAssembly ? sys::fs::F_Text : sys::fs::F_None));
+  if (EC) {
+    errs() << argv[0] << ": " << EC.message() << "\n";
+    return 1;
+  }
+  if (OutputAssembly)
+    M->print(Out->os(), nullptr);
+  else
+    WriteBitcodeToFile(M.get(), Out->os());
+  Out->keep();
+  return 0;
+}
@@ -0,0 +1,203 @@
+// passbench: times the passes on generated IR of growing size, to catch
+// the ones that scale badly before they meet a large real module.
+//
+//   passbench -load MinRegGCM.so -load RedWidth.so -load NVAssume.so
+//             -passes=minreg,redwidth -shapes=chain,wide -sizes=2000,4000
+//
+// Each run happens in a child process, which generates the module, runs
+// the one pass under the legacy pass manager and reports how long the pass
+// took. The parent reads the child's peak resident set size from wait4, so
+// runs do not inflate each other's. Whatever a printing pass prints is
+// discarded.
+//
+// The sizes give one curve per pass and shape. The exponent column is the
+// log-log slope of time over instruction count from the previous size:
+// about 1 when the pass is linear, 2 when it is quadratic. Runs under
+// 10ms are too noisy to give one. With -max-exponent, the exit status is 1
+// when some slope is steeper.
+
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/InitializePasses.h"
+#include "llvm/Pass.h"
+#include "llvm/PassInfo.h"
+#include "llvm/PassRegistry.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/PluginLoader.h"
+#include "llvm/Support/PrettyStackTrace.h"
+#include "llvm/Support/Signals.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "bench/IRGen.h"
+
+#include <chrono>
+#include <cmath>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace llvm;
+using bench::Shape;
+
+static cl::list<std::string> PassNames("passes", cl::CommaSeparated,
+    cl::desc("Passes to time (default: plive,minreg,redwidth,pwidth,nvassume,xlcleanup)"));
+
+static cl::list<Shape> Shapes("shapes", cl::CommaSeparated,
+    cl::desc("Kinds of code to generate (default: all)"),
+    cl::values(clEnumValN(Shape::Chain, "chain", "Chain of control-equivalent diamonds"),
+               clEnumValN(Shape::Loops, "loops", "Deep loop nest"),
+               clEnumValN(Shape::Wide, "wide", "Wide straight-line block"),
+               clEnumValN(Shape::Memory, "memory", "Loads and stores through aliasing pointers"),
+               clEnumValN(Shape::SReg, "sreg", "NVPTX kernel reading special registers")));
+
+static cl::list<unsigned> Sizes("sizes", cl::CommaSeparated,
+    cl::desc("Approximate instruction counts (default: 1000 doubling to 16000)"));
+
+static cl::opt<double> MaxExponent("max-exponent",
+    cl::desc("Fail when time grows faster than this power of the size (0: never)"),
+    cl::init(0));
+
+static const double MinSlopeTime = 0.01;
+
+namespace {
+  // What a child reports back through the pipe
+  struct Sample {
+    unsigned Instrs;
+    double Seconds;
+  };
+
+  struct Result {
+    bool OK;
+    Sample S;
+    long PeakKB;
+  };
+}
+
+static unsigned countInstructions(const Module &M) {
+  unsigned Count = 0;
+  for (auto F = M.begin(), e = M.end(); F != e; ++F)
+    for (auto bb = F->begin(), e = F->end(); bb != e; ++bb)
+      Count += bb->size();
+  return Count;
+}
+
+// Runs in the child, which exits without returning
+static void runChild(const PassInfo *PI, Shape S, unsigned Size, int Fd) {
+  int Null = open("/dev/null", O_WRONLY);
+  if (Null >= 0) {
+    dup2(Null, 1);
+    dup2(Null, 2);
+  }
+
+  LLVMContext Context;
+  std::unique_ptr<Module> M = bench::generate(S, Size, Context);
+  Sample R = {countInstructions(*M), 0};
+
+  legacy::PassManager PM;
+  PM.add(PI->createPass());
+  auto Start = std::chrono::steady_clock::now();
+  PM.run(*M);
+  R.Seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+
+  bool Sent = write(Fd, &R, sizeof(R)) == sizeof(R);
+  _exit(Sent ? 0 : 1);
+}
+
+static Result run(const PassInfo *PI, Shape S, unsigned Size) {
+  Result R = {false, {0, 0}, 0};
+  int Fds[2];
+  if (pipe(Fds))
+    report_fatal_error("passbench: cannot create a pipe");
+  outs().flush();
+  pid_t Pid = fork();
+  if (Pid < 0)
+    report_fatal_error("passbench: cannot fork");
+  if (Pid == 0) {
+    close(Fds[0]);
+    runChild(PI, S, Size, Fds[1]);
+  }
+
+  close(Fds[1]);
+  bool Got = read(Fds[0], &R.S, sizeof(R.S)) == sizeof(R.S);
+  close(Fds[0]);
+  int Status;
+  struct rusage Usage;
+  if (wait4(Pid, &Status, 0, &Usage) != Pid)
+    return R;
+  R.OK = Got && WIFEXITED(Status) && WEXITSTATUS(Status) == 0;
+  R.PeakKB = Usage.ru_maxrss;
+  return R;
+}
+
+int main(int argc, char **argv) {
+  sys::PrintStackTraceOnErrorSignal(argv[0]);
+  PrettyStackTraceProgram X(argc, argv);
+  llvm_shutdown_obj Y;
+
+  PassRegistry &Registry = *PassRegistry::getPassRegistry();
+  initializeCore(Registry);
+  initializeAnalysis(Registry);
+  initializeTransformUtils(Registry);
+
+  cl::ParseCommandLineOptions(argc, argv, "pass scaling benchmark\n");
+
+  std::vector<std::string> Names(PassNames.begin(), PassNames.end());
+  if (Names.empty())
+    Names = {"plive", "minreg", "redwidth", "pwidth", "nvassume", "xlcleanup"};
+  std::vector<Shape> Kinds(Shapes.begin(), Shapes.end());
+  if (Kinds.empty())
+    Kinds = {Shape::Chain, Shape::Loops, Shape::Wide, Shape::Memory, Shape::SReg};
+  std::vector<unsigned> Steps(Sizes.begin(), Sizes.end());
+  if (Steps.empty())
+    for (unsigned s = 1000; s <= 16000; s *= 2)
+      Steps.push_back(s);
+
+  std::vector<const PassInfo *> Infos;
+  for (auto n = Names.begin(), e = Names.end(); n != e; ++n) {
+    const PassInfo *PI = Registry.getPassInfo(*n);
+    if (!PI) {
+      errs() << argv[0] << ": unknown pass " << *n << "; load its plugin with -load\n";
+      return 1;
+    }
+    Infos.push_back(PI);
+  }
+
+  bool Failed = false, TooSteep = false;
+  outs() << "pass       shape     instrs    seconds   peak MB  exponent\n";
+  for (unsigned p = 0; p != Infos.size(); ++p)
+    for (auto k = Kinds.begin(), ke = Kinds.end(); k != ke; ++k) {
+      Result Prev = {false, {0, 0}, 0};
+      for (auto s = Steps.begin(), se = Steps.end(); s != se; ++s) {
+        Result R = run(Infos[p], *k, *s);
+        outs() << format("%-10s %-7s ", Names[p].c_str(), bench::getShapeName(*k));
+        if (!R.OK) {
+          outs() << format("%8u ", *s) << "    failed\n";
+          Failed = true;
+          Prev = R;
+          continue;
+        }
+        outs() << format("%8u %10.4f %9.1f ", R.S.Instrs, R.S.Seconds, R.PeakKB / 1024.0);
+        if (Prev.OK && Prev.S.Seconds >= MinSlopeTime && R.S.Seconds >= MinSlopeTime &&
+            R.S.Instrs > Prev.S.Instrs) {
+          double Exp = std::log(R.S.Seconds / Prev.S.Seconds) /
+                       std::log((double)R.S.Instrs / Prev.S.Instrs);
+          bool Steep = MaxExponent > 0 && Exp > MaxExponent;
+          outs() << format("%9.2f", Exp) << (Steep ? "  too steep" : "") << "\n";
+          TooSteep |= Steep;
+        } else {
+          outs() << "        -\n";
+        }
+        Prev = R;
+      }
+    }
+  return Failed || TooSteep ? 1 : 0;
+}
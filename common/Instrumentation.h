@@ -0,0 +1,31 @@
+#ifndef COMMON_INSTRUMENTATION_H
+#define COMMON_INSTRUMENTATION_H
+
+// Shared measurement hooks for the passes in this repository:
+//
+//  - counters are plain STATISTICs, declared next to the DEBUG_TYPE of each
+//    pass and printed with -stats;
+//  - phase timers below report under -time-passes, one group per pass;
+//  - optimization remarks go through the OptimizationRemarkEmitter, so
+//    -pass-remarks=<pass> prints them and -pass-remarks-output=<file>
+//    writes them as YAML.
+
+#include "llvm/Pass.h"
+
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Analysis/OptimizationDiagnosticInfo.h"
+#include "llvm/Support/Timer.h"
+
+namespace instr {
+  // Times one phase of a pass while -time-passes is on, and costs nothing
+  // otherwise. The phases of a pass share a timer group named after it.
+  class PhaseTimer : public llvm::NamedRegionTimer {
+  public:
+    PhaseTimer(llvm::StringRef Phase, llvm::StringRef Pass)
+      : llvm::NamedRegionTimer(Phase, Phase, Pass, Pass,
+                               llvm::TimePassesIsEnabled) {}
+  };
+}
+
+#endif
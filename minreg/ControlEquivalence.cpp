@@ -0,0 +1,181 @@
+#include "minreg/ControlEquivalence.h"
+
+#include "llvm/ADT/DepthFirstIterator.h"
+#include "llvm/ADT/SmallPtrSet.h"
+
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Function.h"
+
+#include <algorithm>
+#include <iterator>
+
+using namespace llvm;
+using namespace minreg;
+
+const unsigned ControlEquivalence::NoClass;
+
+static const unsigned NoEdge = ~0U;
+static const unsigned NoNum = ~0U;
+
+void ControlEquivalence::clear() {
+  BlockNums.clear();
+  Nodes.clear();
+  EdgeClass.clear();
+  NumClasses = 0;
+}
+
+unsigned ControlEquivalence::addEdge(unsigned A, unsigned B) {
+  unsigned E = EdgeClass.size();
+  EdgeClass.push_back(NoClass);
+  Nodes[A].Adj.push_back(std::make_pair(B, E));
+  Nodes[B].Adj.push_back(std::make_pair(A, E));
+  return E;
+}
+
+void ControlEquivalence::compute(Function &F) {
+  clear();
+
+  // Only reachable blocks take part
+  unsigned NumBlocks = 0;
+  for (BasicBlock *BB : depth_first(&F.getEntryBlock()))
+    BlockNums[BB] = NumBlocks++;
+  unsigned End = 2 * NumBlocks;
+  Nodes.resize(End + 1);
+
+  // Mid edges first, so that edge number B belongs to block B
+  for (unsigned B = 0; B < NumBlocks; ++B)
+    addEdge(2 * B, 2 * B + 1);
+
+  // Blocks that cannot reach a function exit, i.e. those stuck in infinite
+  // loops, get a virtual exit edge as well so that branching into such a
+  // loop still counts as a condition.
+  SmallPtrSet<BasicBlock *, 16> ReachesExit;
+  SmallVector<BasicBlock *, 16> Worklist;
+  for (auto bb = F.begin(), e = F.end(); bb != e; ++bb) {
+    if (BlockNums.count(&*bb) && succ_begin(&*bb) == succ_end(&*bb)) {
+      ReachesExit.insert(&*bb);
+      Worklist.push_back(&*bb);
+    }
+  }
+  while (!Worklist.empty()) {
+    BasicBlock *BB = Worklist.pop_back_val();
+    for (auto p = pred_begin(BB), e = pred_end(BB); p != e; ++p)
+      if (BlockNums.count(*p) && ReachesExit.insert(*p).second)
+        Worklist.push_back(*p);
+  }
+
+  // CFG edges run from the exit half of a block to the entry half of its
+  // successor. Parallel edges and self loops are kept as they are.
+  for (auto bb = F.begin(), e = F.end(); bb != e; ++bb) {
+    auto it = BlockNums.find(&*bb);
+    if (it == BlockNums.end())
+      continue;
+    unsigned B = it->second;
+    for (auto s = succ_begin(&*bb), se = succ_end(&*bb); s != se; ++s)
+      addEdge(2 * B + 1, 2 * BlockNums.lookup(*s));
+    if (succ_begin(&*bb) == succ_end(&*bb) || !ReachesExit.count(&*bb))
+      addEdge(2 * B + 1, End);
+  }
+  addEdge(End, 2 * BlockNums.lookup(&F.getEntryBlock()));
+
+  std::vector<unsigned> Order;
+  walk(End, Order);
+  for (unsigned n = Order.size(); n-- > 0;)
+    assignClasses(Order[n], Order);
+}
+
+// Iterative undirected depth-first walk. Records preorder numbers and tree
+// children; every non-tree edge leads to an ancestor and is kept as a
+// backedge of the lower node.
+void ControlEquivalence::walk(unsigned Root, std::vector<unsigned> &Order) {
+  std::vector<std::pair<unsigned, unsigned>> Stack; // (node, next adjacency)
+  Nodes[Root].DFSNum = Order.size();
+  Order.push_back(Root);
+  Stack.push_back(std::make_pair(Root, 0u));
+  while (!Stack.empty()) {
+    unsigned N = Stack.back().first;
+    if (Stack.back().second == Nodes[N].Adj.size()) {
+      Stack.pop_back();
+      continue;
+    }
+    std::pair<unsigned, unsigned> Next = Nodes[N].Adj[Stack.back().second++];
+    unsigned M = Next.first, E = Next.second;
+    if (E == Nodes[N].ParentEdge)
+      continue;
+    if (Nodes[M].DFSNum == NoNum) {
+      Nodes[M].DFSNum = Order.size();
+      Nodes[M].ParentEdge = E;
+      Order.push_back(M);
+      Nodes[N].Children.push_back(M);
+      Stack.push_back(std::make_pair(M, 0u));
+    } else if (Nodes[M].DFSNum < Nodes[N].DFSNum) {
+      Nodes[N].Backedges.push_back(std::make_pair(M, E));
+    }
+  }
+}
+
+// Runs after all descendants of N: builds the bracket list of the tree edge
+// into N and gives that edge its class.
+void ControlEquivalence::assignClasses(unsigned N, const std::vector<unsigned> &Order) {
+  Node &Nd = Nodes[N];
+
+  unsigned Hi0 = NoNum;
+  for (auto b = Nd.Backedges.begin(), e = Nd.Backedges.end(); b != e; ++b)
+    Hi0 = std::min(Hi0, Nodes[b->first].DFSNum);
+  unsigned Hi1 = NoNum, Hi2 = NoNum;
+  for (auto c = Nd.Children.begin(), e = Nd.Children.end(); c != e; ++c) {
+    unsigned Hi = Nodes[*c].Hi;
+    if (Hi < Hi1) {
+      Hi2 = Hi1;
+      Hi1 = Hi;
+    } else if (Hi < Hi2) {
+      Hi2 = Hi;
+    }
+  }
+  Nd.Hi = std::min(Hi0, Hi1);
+
+  for (auto c = Nd.Children.begin(), e = Nd.Children.end(); c != e; ++c)
+    Nd.Brackets.splice(Nd.Brackets.end(), Nodes[*c].Brackets);
+
+  // Close the brackets ending here. A backedge is in the class of the tree
+  // edges it was the only bracket of, or in one of its own.
+  for (auto b = Nd.Ending.begin(), e = Nd.Ending.end(); b != e; ++b) {
+    Bracket &Br = **b;
+    if (Br.Edge != NoEdge) {
+      if (Br.Class == NoClass)
+        Br.Class = NumClasses++;
+      EdgeClass[Br.Edge] = Br.Class;
+    }
+    Nd.Brackets.erase(*b);
+  }
+  Nd.Ending.clear();
+
+  auto push = [&](unsigned Edge, unsigned Target) {
+    Bracket Br = {Edge, NoClass, 0, NoClass};
+    Nd.Brackets.push_back(Br);
+    Nodes[Target].Ending.push_back(std::prev(Nd.Brackets.end()));
+  };
+  for (auto b = Nd.Backedges.begin(), e = Nd.Backedges.end(); b != e; ++b)
+    push(b->second, b->first);
+  // When two child subtrees reach above N, a capping bracket keeps the edges
+  // below from being equated with those above.
+  if (Hi2 < Hi0 && Hi2 < Nd.DFSNum)
+    push(NoEdge, Order[Hi2]);
+
+  if (Nd.ParentEdge == NoEdge)
+    return;
+  if (Nd.Brackets.empty()) {
+    // A bridge lies on no cycle
+    EdgeClass[Nd.ParentEdge] = NumClasses++;
+    return;
+  }
+  // The topmost bracket and the list size identify the set of cycles
+  Bracket &Top = Nd.Brackets.back();
+  if (Top.RecentSize != Nd.Brackets.size()) {
+    Top.RecentSize = Nd.Brackets.size();
+    Top.RecentClass = NumClasses++;
+  }
+  EdgeClass[Nd.ParentEdge] = Top.RecentClass;
+  if (Top.RecentSize == 1 && Top.Edge != NoEdge)
+    Top.Class = Top.RecentClass;
+}
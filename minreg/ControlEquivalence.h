@@ -0,0 +1,76 @@
+#ifndef MINREG_CONTROLEQUIVALENCE_H
+#define MINREG_CONTROLEQUIVALENCE_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+
+#include <list>
+#include <utility>
+#include <vector>
+
+namespace llvm {
+  class BasicBlock;
+  class Function;
+}
+
+namespace minreg {
+  // Partitions the blocks of a function into control-equivalence classes:
+  // two blocks share a class iff they execute under exactly the same
+  // conditions.
+  //
+  // Each block is split into an entry half and an exit half joined by a
+  // "mid" edge, every exit is joined to a virtual end node, and the end is
+  // joined back to the entry block. Two blocks are then control equivalent
+  // iff their mid edges are cycle equivalent, which the bracket-list
+  // algorithm of Johnson, Pearson and Pingali (PLDI'94) finds in linear
+  // time from one iterative undirected depth-first walk.
+  //
+  // Unreachable blocks are left without a class. Blocks that cannot reach
+  // an exit are joined to the end node as well.
+  class ControlEquivalence {
+  public:
+    static const unsigned NoClass = ~0U;
+
+    void compute(llvm::Function &F);
+    void clear();
+
+    unsigned getClass(const llvm::BasicBlock *BB) const {
+      auto it = BlockNums.find(BB);
+      return it == BlockNums.end() ? NoClass : EdgeClass[it->second];
+    }
+    unsigned getNumClasses() const { return NumClasses; }
+
+  private:
+    struct Bracket {
+      unsigned Edge;        // Backedge this bracket stands for, or NoEdge
+      unsigned Class;       // Class of that edge, once known
+      unsigned RecentSize;  // List size when the bracket was last topmost
+      unsigned RecentClass; // Class handed out at that time
+    };
+    typedef std::list<Bracket> BracketList;
+
+    struct Node {
+      llvm::SmallVector<std::pair<unsigned, unsigned>, 4> Adj; // (node, edge)
+      llvm::SmallVector<unsigned, 4> Children;
+      llvm::SmallVector<std::pair<unsigned, unsigned>, 2> Backedges; // (ancestor, edge)
+      std::vector<BracketList::iterator> Ending; // Brackets that end here
+      BracketList Brackets;
+      unsigned DFSNum = ~0U;
+      unsigned ParentEdge = ~0U;
+      unsigned Hi = ~0U;
+    };
+
+    unsigned addEdge(unsigned A, unsigned B);
+    void walk(unsigned Root, std::vector<unsigned> &Order);
+    void assignClasses(unsigned N, const std::vector<unsigned> &Order);
+
+    // Blocks are numbered densely; block B owns the mid edge B and the nodes
+    // 2B (entry half) and 2B+1 (exit half).
+    llvm::DenseMap<const llvm::BasicBlock *, unsigned> BlockNums;
+    std::vector<Node> Nodes;
+    std::vector<unsigned> EdgeClass;
+    unsigned NumClasses = 0;
+  };
+}
+
+#endif
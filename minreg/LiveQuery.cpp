@@ -0,0 +1,211 @@
+#include "minreg/LiveQuery.h"
+
+#include "llvm/ADT/DepthFirstIterator.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+
+#include "llvm/Analysis/LoopInfo.h"
+
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+
+#include <algorithm>
+#include <utility>
+
+using namespace llvm;
+using namespace minreg;
+
+// The block a use reads its value in. PHI operands are read at the end of
+// the incoming block rather than in the PHI's own block.
+static const BasicBlock *getUseBlock(const Use &U, bool &AtEnd) {
+  const Instruction *UI = cast<Instruction>(U.getUser());
+  if (const PHINode *P = dyn_cast<PHINode>(UI)) {
+    AtEnd = true;
+    return P->getIncomingBlock(U);
+  }
+  AtEnd = false;
+  return UI->getParent();
+}
+
+void LivenessQuery::clear() {
+  LI = nullptr;
+  Irreducible = false;
+  Num.clear();
+  MaxDom.clear();
+  Reach.clear();
+}
+
+void LivenessQuery::compute(Function &F, DominatorTree &DT, LoopInfo &LoopI) {
+  clear();
+  LI = &LoopI;
+
+  // Number reachable blocks in dominator-tree preorder, so that the blocks
+  // dominated by N are exactly the numbers [N, MaxDom[N]].
+  std::vector<DomTreeNode *> Order;
+  for (auto N = df_begin(DT.getRootNode()), E = df_end(DT.getRootNode()); N != E; ++N) {
+    Num[N->getBlock()] = Order.size();
+    Order.push_back(*N);
+  }
+  unsigned NumBlocks = Order.size();
+  MaxDom.resize(NumBlocks);
+  for (unsigned n = NumBlocks; n-- > 0;) {
+    MaxDom[n] = n;
+    for (auto c = Order[n]->begin(), e = Order[n]->end(); c != e; ++c)
+      MaxDom[n] = std::max(MaxDom[n], MaxDom[Num[(*c)->getBlock()]]);
+  }
+
+  // Depth-first walk of the CFG. Edges to blocks still on the stack are
+  // back edges; every other successor finishes first, so reduced
+  // reachability can be accumulated in post-order.
+  enum { Unvisited, OnStack, Done };
+  std::vector<char> State(NumBlocks, Unvisited);
+  Reach.assign(NumBlocks, BitVector(NumBlocks));
+  std::vector<std::pair<BasicBlock *, succ_iterator>> Stack;
+  BasicBlock *Entry = &F.getEntryBlock();
+  State[Num[Entry]] = OnStack;
+  Stack.push_back(std::make_pair(Entry, succ_begin(Entry)));
+  while (!Stack.empty()) {
+    BasicBlock *BB = Stack.back().first;
+    succ_iterator &S = Stack.back().second;
+    if (S != succ_end(BB)) {
+      BasicBlock *Succ = *S;
+      ++S;
+      unsigned SN = Num[Succ];
+      if (State[SN] == Unvisited) {
+        State[SN] = OnStack;
+        Stack.push_back(std::make_pair(Succ, succ_begin(Succ)));
+      } else if (State[SN] == OnStack && !DT.dominates(Succ, BB)) {
+        // A retreating edge into a block that does not dominate its
+        // source: loop headers no longer describe the cycles.
+        Irreducible = true;
+      }
+      continue;
+    }
+
+    unsigned BN = Num[BB];
+    Reach[BN].set(BN);
+    for (auto s = succ_begin(BB), e = succ_end(BB); s != e; ++s) {
+      unsigned SN = Num[*s];
+      if (State[SN] == Done)
+        Reach[BN] |= Reach[SN];
+    }
+    State[BN] = Done;
+    Stack.pop_back();
+  }
+}
+
+bool LivenessQuery::isLiveIn(const Value *V, const BasicBlock *BB) const {
+  return query(V, BB, false);
+}
+
+bool LivenessQuery::isLiveOut(const Value *V, const BasicBlock *BB) const {
+  return query(V, BB, true);
+}
+
+bool LivenessQuery::query(const Value *V, const BasicBlock *Q, bool Out) const {
+  assert(LI != nullptr && "Liveness queries used before compute()");
+  if (!isReachable(Q))
+    return false;
+
+  // Arguments are treated as defined above the entry block
+  const BasicBlock *DefBB = nullptr;
+  if (const Instruction *I = dyn_cast<Instruction>(V))
+    DefBB = I->getParent();
+  else if (!isa<Argument>(V))
+    return false;
+  if (DefBB && !isReachable(DefBB))
+    return false;
+
+  if (DefBB == Q) {
+    if (!Out)
+      return false; // Defined here, PHIs included
+    for (auto u = V->use_begin(), e = V->use_end(); u != e; ++u) {
+      if (!isa<Instruction>(u->getUser()))
+        continue;
+      bool AtEnd;
+      const BasicBlock *UseBB = getUseBlock(*u, AtEnd);
+      if (isReachable(UseBB) && (UseBB != Q || AtEnd))
+        return true;
+    }
+    return false;
+  }
+
+  if (Irreducible)
+    return queryByWalk(V, Q, Out);
+
+  // Only blocks strictly dominated by the definition can have it live-in
+  unsigned QN = Num.lookup(Q);
+  unsigned DN = DefBB ? Num.lookup(DefBB) : 0;
+  auto strictlyDominated = [&](unsigned N) {
+    return !DefBB || (N > DN && N <= MaxDom[DN]);
+  };
+  if (!strictlyDominated(QN))
+    return false;
+
+  // Q can reach a use without crossing the definition iff the use is in the
+  // reduced reach of Q, or of a header of a loop around Q that the
+  // definition strictly dominates. Headers are visited innermost first, and
+  // once one is not dominated by the definition no outer header can be.
+  SmallVector<const BasicBlock *, 4> Targets;
+  Targets.push_back(Q);
+  for (const Loop *L = LI->getLoopFor(Q); L; L = L->getParentLoop())
+    if (L->getHeader() != Q)
+      Targets.push_back(L->getHeader());
+
+  for (auto t = Targets.begin(), te = Targets.end(); t != te; ++t) {
+    unsigned TN = Num.lookup(*t);
+    if (!strictlyDominated(TN))
+      break;
+    // From the end of Q, uses inside Q are only reachable around a loop
+    bool SkipQ = Out && *t == Q && !LI->isLoopHeader(Q);
+    for (auto u = V->use_begin(), e = V->use_end(); u != e; ++u) {
+      if (!isa<Instruction>(u->getUser()))
+        continue;
+      bool AtEnd;
+      const BasicBlock *UseBB = getUseBlock(*u, AtEnd);
+      if (!isReachable(UseBB) || (SkipQ && UseBB == Q && !AtEnd))
+        continue;
+      if (Reach[TN].test(Num.lookup(UseBB)))
+        return true;
+    }
+  }
+  return false;
+}
+
+bool LivenessQuery::queryByWalk(const Value *V, const BasicBlock *Q, bool Out) const {
+  const BasicBlock *DefBB = nullptr;
+  if (const Instruction *I = dyn_cast<Instruction>(V))
+    DefBB = I->getParent();
+
+  // Collect the blocks V is live-in to by walking backwards from its uses,
+  // stopping at the definition.
+  SmallPtrSet<const BasicBlock *, 16> LiveIn;
+  SmallVector<const BasicBlock *, 16> Worklist;
+  for (auto u = V->use_begin(), e = V->use_end(); u != e; ++u) {
+    if (!isa<Instruction>(u->getUser()))
+      continue;
+    bool AtEnd;
+    const BasicBlock *UseBB = getUseBlock(*u, AtEnd);
+    if (!isReachable(UseBB))
+      continue;
+    if (Out && AtEnd && UseBB == Q)
+      return true;
+    if (UseBB != DefBB && LiveIn.insert(UseBB).second)
+      Worklist.push_back(UseBB);
+  }
+  while (!Worklist.empty()) {
+    const BasicBlock *BB = Worklist.pop_back_val();
+    for (auto p = pred_begin(BB), e = pred_end(BB); p != e; ++p)
+      if (*p != DefBB && isReachable(*p) && LiveIn.insert(*p).second)
+        Worklist.push_back(*p);
+  }
+
+  if (!Out)
+    return LiveIn.count(Q) > 0;
+  for (auto s = succ_begin(Q), e = succ_end(Q); s != e; ++s)
+    if (LiveIn.count(*s))
+      return true;
+  return false;
+}
@@ -0,0 +1,55 @@
+#ifndef MINREG_LIVEQUERY_H
+#define MINREG_LIVEQUERY_H
+
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/DenseMap.h"
+
+#include <vector>
+
+namespace llvm {
+  class BasicBlock;
+  class DominatorTree;
+  class Function;
+  class LoopInfo;
+  class Value;
+}
+
+namespace minreg {
+  // Answers "is V live-in/live-out at BB" on demand, without materializing
+  // liveness sets, following Boissinot et al., "Fast Liveness Checking for
+  // SSA-Form Programs" (CGO'08).
+  //
+  // The precomputation only looks at the CFG: blocks are numbered in
+  // dominator-tree preorder and each block records what it reaches in the
+  // CFG with loop back edges removed. Uses are read from the IR at query
+  // time, so answers stay correct while instructions are moved, cloned or
+  // erased, as long as the CFG itself is left alone.
+  //
+  // Irreducible CFGs fall back to a backward walk from the uses.
+  class LivenessQuery {
+  public:
+    void compute(llvm::Function &F, llvm::DominatorTree &DT, llvm::LoopInfo &LI);
+    void clear();
+
+    bool isLiveIn(const llvm::Value *V, const llvm::BasicBlock *BB) const;
+    bool isLiveOut(const llvm::Value *V, const llvm::BasicBlock *BB) const;
+
+  private:
+    bool isReachable(const llvm::BasicBlock *BB) const {
+      return Num.count(BB) > 0;
+    }
+    bool query(const llvm::Value *V, const llvm::BasicBlock *BB, bool Out) const;
+    bool queryByWalk(const llvm::Value *V, const llvm::BasicBlock *BB, bool Out) const;
+
+    llvm::LoopInfo *LI = nullptr;
+    bool Irreducible = false;
+    // Dominator-tree preorder number of each reachable block, and the
+    // largest number in its dominator subtree.
+    llvm::DenseMap<const llvm::BasicBlock *, unsigned> Num;
+    std::vector<unsigned> MaxDom;
+    // Reduced reachability, indexed by preorder number
+    std::vector<llvm::BitVector> Reach;
+  };
+}
+
+#endif
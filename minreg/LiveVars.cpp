@@ -1,4 +1,3 @@
-
 #include "llvm/Pass.h"
 
 #include "llvm/IR/CFG.h"
@@ -8,115 +7,136 @@
 #include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Analysis/CFG.h"
 
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/raw_ostream.h"
 
-#include <unordered_map>
-#include <unordered_set>
+#include "minreg/LiveQuery.h"
+#include "minreg/Liveness.h"
+#include "minreg/RegPressure.h"
 
 using namespace llvm;
 
-namespace {
-  using namespace std;
+static cl::opt<bool> VerifyQueries("plive-verify",
+    cl::desc("Cross-check on-demand liveness queries against the dataflow sets"),
+    cl::init(false));
 
-  typedef unordered_map<BasicBlock *, unordered_set<Instruction *>> LiveMap;
+// Values defined in a block print with that block's name
+static StringRef defBlockName(Value *V) {
+  if (Instruction *I = dyn_cast<Instruction>(V))
+    return I->getParent()->getName();
+  return cast<Argument>(V)->getParent()->getEntryBlock().getName();
+}
 
-  struct LiveRange : public FunctionPass {
-    static char ID;
-    LiveRange() : FunctionPass(ID) {}
+static void verifyQueries(Function &F, const minreg::Liveness &Live,
+                          DominatorTree &DT, LoopInfo &LI) {
+  minreg::LivenessQuery Query;
+  Query.compute(F, DT, LI);
+  for (unsigned n = 0, e = Live.getNumValues(); n != e; ++n) {
+    Value *V = Live.getValue(n);
+    for (auto BB = F.begin(), be = F.end(); BB != be; ++BB) {
+      if (!DT.isReachableFromEntry(&*BB))
+        continue;
+      if (Query.isLiveIn(V, &*BB) != Live.isLiveIn(V, &*BB))
+        errs() << "Live-in mismatch for " << V->getName() << " in " << BB->getName() << "\n";
+      if (Query.isLiveOut(V, &*BB) != Live.isLiveOut(V, &*BB))
+        errs() << "Live-out mismatch for " << V->getName() << " in " << BB->getName() << "\n";
+    }
+  }
+}
 
-    LiveMap LiveIn;
-    LiveMap LiveOut;
+static void printLiveness(Function &F, const minreg::Liveness &Live) {
+  for (auto BB = F.begin(), e = F.end(); BB != e; ++BB) {
+    const minreg::Liveness::ValueSet &In = Live.getLiveIn(&*BB);
+    const minreg::Liveness::ValueSet &Out = Live.getLiveOut(&*BB);
+    errs() << "\n\nBasic Block: " << BB->getName() << "\n";
+    for (auto in = In.begin(), e = In.end(); in != e; ++in) {
+      if(!Out.test(*in)) // Only in
+        errs() << " IN   " << Live.getValue(*in)->getName() << " from " << defBlockName(Live.getValue(*in)) << "\n";
+    }
+    for (auto out = Out.begin(), e = Out.end(); out != e; ++out) {
+      if(!In.test(*out)) // Only out
+        errs() << " OUT  " << Live.getValue(*out)->getName() << "\n";
+    }
+    for (auto in = In.begin(), e = In.end(); in != e; ++in) {
+      if(Out.test(*in)) // Live across
+        errs() << " THRU " << Live.getValue(*in)->getName() << " from " << defBlockName(Live.getValue(*in)) << "\n";
+    }
+  }
+}
 
-    bool runOnInstructionDFS(Instruction *i, BasicBlock *bb, unordered_set<Instruction *>& users, unordered_set<BasicBlock *>& visited) {
-      if(visited.count(bb) > 0) // Already visited
-        return LiveIn[bb].count(i) > 0; // Visited block contained a use or through-use of i
-      visited.insert(bb);
+static void printPressure(Function &F, const minreg::RegisterPressure &RP) {
+  errs() << "Function " << F.getName() << " peak ";
+  RP.getMaxByClass().print(errs());
+  errs() << ", max live " << RP.getMaxPressure() << " in";
+  for (auto bb = RP.getPeakBlocks().begin(), e = RP.getPeakBlocks().end(); bb != e; ++bb)
+    errs() << " " << (*bb)->getName();
+  errs() << "\n";
+
+  for (auto BB = F.begin(), e = F.end(); BB != e; ++BB) {
+    errs() << "\nBasic Block: " << BB->getName() << " max ";
+    RP.getBlockMax(&*BB).print(errs());
+    errs() << "\n";
+    for (auto I = BB->begin(), e = BB->end(); I != e; ++I) {
+      errs() << "  " << RP.getPressureAt(&*I).total() << "\t" << *I << "\n";
+    }
+  }
+}
 
-      bool found = false;
-      for (auto I = bb->begin(), e = bb->end(); I != e; ++I) {
-        found |= users.count(&*I) > 0; // Found a use in this basic block
-      }
+namespace {
+  struct LiveRange : public FunctionPass {
+    static char ID;
+    LiveRange() : FunctionPass(ID) {}
 
-      bool foundBelow = false;
-      for (auto S = succ_begin(bb), e = succ_end(bb); S != e; ++S) {
-        foundBelow |= runOnInstructionDFS(i, *S, users, visited);
-      }
+    minreg::Liveness Live;
 
-      if (found || foundBelow) {
-        LiveIn[bb].insert(i);
-      } if (foundBelow) {
-        LiveOut[bb].insert(i);
+    void getAnalysisUsage(AnalysisUsage& AU) const override {
+      // The dominator tree and loops are only needed to cross-check queries
+      if (VerifyQueries) {
+        AU.addRequired<DominatorTreeWrapperPass>();
+        AU.addRequired<LoopInfoWrapperPass>();
       }
+      AU.setPreservesAll();
+    }
 
-      return found || foundBelow;
+    bool runOnFunction(Function &F) override {
+      Live.compute(F);
+      if (VerifyQueries)
+        verifyQueries(F, Live, getAnalysis<DominatorTreeWrapperPass>().getDomTree(),
+                      getAnalysis<LoopInfoWrapperPass>().getLoopInfo());
+      printLiveness(F, Live);
+      return false;
     }
 
-    void runOnInstruction(Instruction *i) {
-      BasicBlock *BB = i->getParent();
-
-      // Build the inter-block users set
-      unordered_set<Instruction *> users;
-      for (auto u = i->use_begin(), e = i->use_end(); u != e; ++u) {
-        if (Instruction *user = dyn_cast<Instruction>(u->getUser())) {
-          if (user->getParent() != BB) {
-            users.insert(user);
-          }
-        } else {
-          assert(false && "User found that is not an instruction");
-        }
-      }
+    void releaseMemory() override {
+      Live.clear();
+    }
+  };
 
-      if (users.empty()) {
-        return;
-      }
+  struct PrintPressure : public FunctionPass {
+    static char ID;
+    PrintPressure() : FunctionPass(ID) {}
 
-      unordered_set<BasicBlock *> visited;
-      visited.insert(BB);
-      LiveOut[BB].insert(i);
-
-      for (auto S = succ_begin(BB), e = succ_end(BB); S != e; ++S) {
-        runOnInstructionDFS(i, *S, users, visited);
-      }
-    }
+    minreg::Liveness Live;
+    minreg::RegisterPressure RP;
 
     void getAnalysisUsage(AnalysisUsage& AU) const override {
-      AU.addRequired<DominatorTreeWrapperPass>();
-      AU.addRequired<LoopInfoWrapperPass>();
+      AU.setPreservesAll();
     }
 
     bool runOnFunction(Function &F) override {
-      // Set up the sets
-      for (auto BB = F.begin(), e = F.end(); BB != e; ++BB) {
-        LiveIn[&*BB] = unordered_set<Instruction *>();
-        LiveOut[&*BB] = unordered_set<Instruction *>();
-      }
-
-      // Get live ranges for all instructions
-      for (auto BB = F.begin(), e = F.end(); BB != e; ++BB) {
-        for (auto I = BB->begin(), e = BB->end(); I != e; ++I) {
-          runOnInstruction(&*I);
-        }
-      }
-
-      // Print out the results
-      for (auto BB = F.begin(), e = F.end(); BB != e; ++BB) {
-        errs() << "\n\nBasic Block: " << BB->getName() << "\n";
-        for (auto in = LiveIn[&*BB].begin(), e = LiveIn[&*BB].end(); in != e; ++in) {
-          if(LiveOut[&*BB].count(*in) == 0) // Only in
-            errs() << " IN   " << (*in)->getName() << " from " << (*in)->getParent()->getName() << "\n";
-        }
-        for (auto out = LiveOut[&*BB].begin(), e = LiveOut[&*BB].end(); out != e; ++out) {
-          if(LiveIn[&*BB].count(*out) == 0) // Only out
-            errs() << " OUT  " << (*out)->getName() << "\n";
-        }
-        for (auto in = LiveIn[&*BB].begin(), e = LiveIn[&*BB].end(); in != e; ++in) {
-          if(LiveOut[&*BB].count(*in) != 0) // Live across
-            errs() << " THRU " << (*in)->getName() << " from " << (*in)->getParent()->getName() << "\n";
-        }
-      }
+      Live.compute(F);
+      RP.compute(F, Live);
+      printPressure(F, RP);
       return false;
     }
+
+    void releaseMemory() override {
+      RP.clear();
+      Live.clear();
+    }
   };
 }
 char LiveRange::ID = 0;
 static RegisterPass<LiveRange> X("plive", "Print Live-in, Live-out, and Live-across variables", false, false);
+char PrintPressure::ID = 0;
+static RegisterPass<PrintPressure> Y("ppressure", "Print register pressure at every program point", false, false);
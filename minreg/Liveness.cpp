@@ -0,0 +1,138 @@
+#include "minreg/Liveness.h"
+
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/PostOrderIterator.h"
+
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+
+using namespace llvm;
+using namespace minreg;
+
+void Liveness::clear() {
+  ValueNums.clear();
+  Values.clear();
+  BlockNums.clear();
+  LiveIn.clear();
+  LiveOut.clear();
+}
+
+unsigned Liveness::getValueNumber(const Value *V) const {
+  auto it = ValueNums.find(V);
+  assert(it != ValueNums.end() && "Value is not tracked");
+  return it->second;
+}
+
+unsigned Liveness::getBlockNumber(const BasicBlock *BB) const {
+  auto it = BlockNums.find(BB);
+  assert(it != BlockNums.end() && "Block is not part of the function");
+  return it->second;
+}
+
+const Liveness::ValueSet &Liveness::getLiveIn(const BasicBlock *BB) const {
+  return LiveIn[getBlockNumber(BB)];
+}
+
+const Liveness::ValueSet &Liveness::getLiveOut(const BasicBlock *BB) const {
+  return LiveOut[getBlockNumber(BB)];
+}
+
+bool Liveness::isLiveIn(const Value *V, const BasicBlock *BB) const {
+  auto it = ValueNums.find(V);
+  return it != ValueNums.end() && getLiveIn(BB).test(it->second);
+}
+
+bool Liveness::isLiveOut(const Value *V, const BasicBlock *BB) const {
+  auto it = ValueNums.find(V);
+  return it != ValueNums.end() && getLiveOut(BB).test(it->second);
+}
+
+void Liveness::compute(Function &F) {
+  clear();
+
+  // Number the blocks and every value that can occupy a register
+  for (auto a = F.arg_begin(), e = F.arg_end(); a != e; ++a) {
+    ValueNums[&*a] = Values.size();
+    Values.push_back(&*a);
+  }
+  unsigned NumBlocks = 0;
+  for (auto bb = F.begin(), e = F.end(); bb != e; ++bb) {
+    BlockNums[&*bb] = NumBlocks++;
+    for (auto i = bb->begin(), e = bb->end(); i != e; ++i) {
+      if (i->getType()->isVoidTy())
+        continue;
+      ValueNums[&*i] = Values.size();
+      Values.push_back(&*i);
+    }
+  }
+
+  std::vector<ValueSet> UpwardExposed(NumBlocks);
+  std::vector<ValueSet> Defs(NumBlocks);
+  LiveIn.assign(NumBlocks, ValueSet());
+  LiveOut.assign(NumBlocks, ValueSet());
+
+  // Local use/def summaries. PHI operands are used on the incoming edge,
+  // so they seed LiveOut of the predecessor instead of this block.
+  for (auto bb = F.begin(), e = F.end(); bb != e; ++bb) {
+    unsigned B = BlockNums[&*bb];
+    for (auto i = bb->begin(), e = bb->end(); i != e; ++i) {
+      if (PHINode *P = dyn_cast<PHINode>(i)) {
+        for (unsigned op = 0, n = P->getNumIncomingValues(); op < n; ++op) {
+          auto it = ValueNums.find(P->getIncomingValue(op));
+          if (it != ValueNums.end())
+            LiveOut[BlockNums[P->getIncomingBlock(op)]].set(it->second);
+        }
+      } else {
+        for (auto op = i->op_begin(), e = i->op_end(); op != e; ++op) {
+          auto it = ValueNums.find(op->get());
+          if (it != ValueNums.end() && !Defs[B].test(it->second))
+            UpwardExposed[B].set(it->second);
+        }
+      }
+      auto it = ValueNums.find(&*i);
+      if (it != ValueNums.end())
+        Defs[B].set(it->second);
+    }
+  }
+
+  // Backward worklist. Reachable blocks are pushed in reverse post-order on
+  // top of the others so they pop in post-order, and most blocks see their
+  // successors' final sets on the first visit.
+  std::vector<BasicBlock *> Worklist;
+  BitVector OnWorklist(NumBlocks);
+  for (auto bb = F.begin(), e = F.end(); bb != e; ++bb) {
+    Worklist.push_back(&*bb);
+    OnWorklist.set(BlockNums[&*bb]);
+  }
+  ReversePostOrderTraversal<Function *> RPOT(&F);
+  for (auto bb = RPOT.begin(), e = RPOT.end(); bb != e; ++bb)
+    Worklist.push_back(*bb);
+
+  while (!Worklist.empty()) {
+    BasicBlock *BB = Worklist.back();
+    Worklist.pop_back();
+    unsigned B = BlockNums[BB];
+    if (!OnWorklist.test(B))
+      continue; // Duplicate of an earlier seed
+    OnWorklist.reset(B);
+
+    for (auto s = succ_begin(BB), e = succ_end(BB); s != e; ++s)
+      LiveOut[B] |= LiveIn[BlockNums[*s]];
+
+    ValueSet NewIn;
+    NewIn.intersectWithComplement(LiveOut[B], Defs[B]);
+    NewIn |= UpwardExposed[B];
+    if (NewIn == LiveIn[B])
+      continue;
+
+    LiveIn[B] = NewIn;
+    for (auto p = pred_begin(BB), e = pred_end(BB); p != e; ++p) {
+      unsigned P = BlockNums[*p];
+      if (!OnWorklist.test(P)) {
+        OnWorklist.set(P);
+        Worklist.push_back(*p);
+      }
+    }
+  }
+}
@@ -0,0 +1,55 @@
+#ifndef MINREG_LIVENESS_H
+#define MINREG_LIVENESS_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SparseBitVector.h"
+
+#include <vector>
+
+namespace llvm {
+  class BasicBlock;
+  class Function;
+  class Value;
+}
+
+namespace minreg {
+  // Block-level liveness for every SSA value in a function.
+  //
+  // Arguments and value-producing instructions are numbered densely, and
+  // LiveIn/LiveOut are solved with a backward worklist dataflow over sparse
+  // bit vectors. Uses by PHI nodes are treated as uses at the end of the
+  // incoming block, so PHI operands are live-out of their predecessor and
+  // PHI results are not live-in to their own block.
+  class Liveness {
+  public:
+    typedef llvm::SparseBitVector<> ValueSet;
+
+    // Discards any previous results and solves liveness for F
+    void compute(llvm::Function &F);
+    void clear();
+
+    bool isTracked(const llvm::Value *V) const {
+      return ValueNums.count(V) > 0;
+    }
+    unsigned getNumValues() const { return Values.size(); }
+    unsigned getValueNumber(const llvm::Value *V) const;
+    llvm::Value *getValue(unsigned N) const { return Values[N]; }
+
+    const ValueSet &getLiveIn(const llvm::BasicBlock *BB) const;
+    const ValueSet &getLiveOut(const llvm::BasicBlock *BB) const;
+
+    bool isLiveIn(const llvm::Value *V, const llvm::BasicBlock *BB) const;
+    bool isLiveOut(const llvm::Value *V, const llvm::BasicBlock *BB) const;
+
+  private:
+    unsigned getBlockNumber(const llvm::BasicBlock *BB) const;
+
+    llvm::DenseMap<const llvm::Value *, unsigned> ValueNums;
+    std::vector<llvm::Value *> Values;
+    llvm::DenseMap<const llvm::BasicBlock *, unsigned> BlockNums;
+    std::vector<ValueSet> LiveIn;
+    std::vector<ValueSet> LiveOut;
+  };
+}
+
+#endif
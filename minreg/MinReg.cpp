@@ -1,99 +1,105 @@
 #include "llvm/Pass.h"
 
-#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/Analysis/AliasAnalysis.h"
-#include "llvm/Analysis/AliasSetTracker.h"
 #include "llvm/Analysis/BasicAliasAnalysis.h"
 #include "llvm/Analysis/ScalarEvolutionAliasAnalysis.h"
 #include "llvm/Analysis/Loads.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/MemoryLocation.h"
+#include "llvm/Analysis/MemorySSA.h"
+#include "llvm/Analysis/MemorySSAUpdater.h"
 #include "llvm/Analysis/PostDominators.h"
 
 #include "llvm/IR/CFG.h"
+#include "llvm/IR/CallSite.h"
 #include "llvm/IR/Dominators.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
 
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
 #include "llvm/Support/raw_ostream.h"
 
+#include "common/Instrumentation.h"
+#include "minreg/ControlEquivalence.h"
+#include "minreg/LiveQuery.h"
+#include "minreg/Liveness.h"
+#include "minreg/RegPressure.h"
+#include "minreg/Scheduler.h"
+
 #include <algorithm>
 #include <vector>
-#include <unordered_map>
-#include <unordered_set>
 
 
 using namespace llvm;
 
+#define DEBUG_TYPE "minreg"
+
+STATISTIC(NumChains, "Number of control-equivalent chains with more than one block");
+STATISTIC(NumHoisted, "Number of instructions hoisted along chains");
+STATISTIC(NumSunk, "Number of instructions sunk along chains");
+STATISTIC(NumMemHoisted, "Number of loads and read-only calls hoisted");
+STATISTIC(NumMemSunk, "Number of loads and read-only calls sunk");
+STATISTIC(NumRemat, "Number of values rematerialized");
+STATISTIC(NumRematClones, "Number of rematerialized copies inserted");
+STATISTIC(NumScheduled, "Number of blocks reordered to lower peak pressure");
+
+static cl::opt<bool> Rematerialize("minreg-remat",
+    cl::desc("Recompute cheap values next to distant uses instead of keeping them live"),
+    cl::init(false));
+
+static cl::opt<unsigned> RematMaxClones("minreg-remat-max-clones",
+    cl::desc("Largest number of blocks a value is recomputed in"),
+    cl::init(4));
+
+static cl::opt<unsigned> RematPressure("minreg-remat-pressure",
+    cl::desc("Only rematerialize values live into blocks with at least this many "
+             "live values (0 uses the function's peak)"),
+    cl::init(0));
+
+static cl::opt<bool> ScheduleBlocks("minreg-schedule",
+    cl::desc("Reorder instructions within blocks to lower peak register pressure"),
+    cl::init(true));
+
+static cl::opt<unsigned> SchedPreciseLimit("minreg-sched-precise-limit",
+    cl::desc("Largest block scheduled with alias analysis and pressure tracking; "
+             "larger blocks use a static Sethi-Ullman order"),
+    cl::init(256));
+
 namespace {
+  // Blocks of one control-equivalence class in dominance order. Between
+  // consecutive blocks lie the blocks of the region they enclose.
   class Chain {
   private:
     std::vector<BasicBlock *> chain;
-    std::unordered_map<BasicBlock *, std::vector<BasicBlock *>> between;
   public:
     Chain(BasicBlock * root) {
       chain.push_back(root);
     }
 
-    bool contains(BasicBlock *BB) {
-      for(auto bb = chain.begin(), e = chain.end(); bb != e; ++bb)
-        if(*bb == BB)
-          return true;
-      return false;
-    }
-
     void append(BasicBlock * next) {
-      assert(chain.size() > 0);
-      BasicBlock * last = chain.back();
-      // Insert the new end of the chain
       chain.push_back(next);
-
-      std::unordered_set<BasicBlock *> fromLast;
-      std::unordered_set<BasicBlock *> toNext;
-
-      // Initialize the queue
-      std::vector<BasicBlock *> queue;
-      queue.push_back(last);
-
-      // Find all successors
-      while(queue.size() != 0) {
-        BasicBlock * BB = queue.back();
-        queue.pop_back();
-        for(auto s = succ_begin(BB), e = succ_end(BB); s != e; ++s) {
-          if(fromLast.count(*s) == 0 && *s != next) {
-            fromLast.insert(*s);
-            queue.push_back(*s);
-          }
-        }
-      }
-
-      // Initialize the queue
-      queue.push_back(next);
-
-      // Find all predecessors
-      while(queue.size() != 0) {
-        BasicBlock * BB = queue.back();
-        queue.pop_back();
-        for(auto p = pred_begin(BB), e = pred_end(BB); p != e; ++p) {
-          if(toNext.count(*p) == 0 && *p != last) {
-            toNext.insert(*p);
-            queue.push_back(*p);
-          }
-        }
-      }
-
-      // Calculate the overlapping intersection
-      std::vector<BasicBlock *> intersection;
-      for(auto bb = fromLast.begin(), e = fromLast.end(); bb != e; ++bb)
-        if(toNext.count(*bb) > 0)
-          intersection.push_back(*bb);
-
-      // Assign the possible nodes between the basic blocks
-      between[last] = intersection;
     }
 
+    // Is BB between chain[i] and chain[i+1]: strictly dominated by chain[i]
+    // and post-dominated by chain[i+1], outside the dominator subtree of
+    // chain[i+1]? Constant time while both trees have up-to-date DFS
+    // numbers, which instruction motion leaves alone.
+    bool isBetween(size_t i, BasicBlock *BB, const DominatorTree &DT,
+                   const PostDominatorTree &PDT) const {
+      BasicBlock *last = chain[i], *next = chain[i+1];
+      return BB != last && DT.dominates(last, BB) && !DT.dominates(next, BB) &&
+             PDT.getNode(BB) && PDT.dominates(next, BB);
+    }
 
     void dump() {
-      errs() << "Chain (" << chain.size() << " blocks)\n";
+      dbgs() << "Chain (" << chain.size() << " blocks)\n";
       for(auto bb = chain.begin(), e = chain.end(); bb != e; ++bb) {
-        errs() <<"- " << (*bb)->getName() << "\n";
+        dbgs() <<"- " << (*bb)->getName() << "\n";
       }
     }
 
@@ -105,80 +111,80 @@ namespace {
       return chain[i];
     }
 
-    const std::vector<BasicBlock *>& blocksBetween(size_t i) {
-      return between[chain[i]];
-    }
-
     static bool singleElem(Chain& chain) {
       return chain.chain.size() == 1;
     }
   };
-  struct MinReg : public FunctionPass {
-    static char ID;
-    MinReg() : FunctionPass(ID) {}
-    AliasAnalysis *AA;
-    DominatorTree *DT;
-    PostDominatorTree *PDT;
+  // Estimated change in register usage across a chain link from moving one
+  // instruction. Predicates live in their own register file, everything
+  // else is counted in 32-bit register units.
+  struct MoveCost {
+    int Units = 0;
+    int Preds = 0;
+
+    void add(Value *V, int Sign, const DataLayout &DL) {
+      if (minreg::getRegClass(V->getType()) == minreg::RC_Pred)
+        Preds += Sign;
+      else
+        Units += Sign * (int)minreg::getRegUnits(V->getType(), DL);
+    }
 
-    void getAnalysisUsage(AnalysisUsage& AU) const override {
-      AU.addRequired<DominatorTreeWrapperPass>();
-      AU.addRequired<PostDominatorTreeWrapperPass>();
-      AU.addRequired<AAResultsWrapperPass>();
+    // Only commit moves that shorten live ranges without growing either file
+    bool isProfitable() const {
+      return (Units < 0 && Preds <= 0) || (Units <= 0 && Preds < 0);
     }
+  };
 
-    void createChains(std::vector<Chain>& chains, BasicBlock * BB) {
-      errs() << "Starting chain with " << BB->getName() << "\n";
-      chains.push_back(Chain(BB));
-      size_t index = chains.size()-1;
-      bool didSomething = true;
-
-      while(didSomething) {
-        didSomething = false;
-        for(auto s = succ_begin(BB), e = succ_end(BB); s != e; ++s) {
-          if(DT->dominates(BB, *s) && PDT->dominates(*s, BB)) {
-
-            errs() << "Appending " << (*s)->getName() << " to chain\n";
-            // Attach to the current chain
-            chains[index].append(*s);
-            BB = *s;
-            didSomething = true;
-          } else {
-            bool contained = false;
-            for(auto c = chains.begin(), e = chains.end(); c != e; ++c) {
-              contained = contained || c->contains(*s);
-            }
-            if(!contained) {
-              // Begin a new chain
-              createChains(chains, *s);
-            }
-          }
+  // The pass itself, run by the legacy pass wrapper below
+  struct MinRegImpl {
+    AliasAnalysis *AA;
+    DominatorTree *DT;
+    PostDominatorTree *PDT;
+    MemorySSA *MSSA;
+    MemorySSAUpdater *MSSAU = nullptr;
+    OptimizationRemarkEmitter *ORE;
+    minreg::LivenessQuery LQ;
+    minreg::ControlEquivalence CE;
+
+    // One chain per control-equivalence class. Members of a class are
+    // totally ordered by dominance, so reverse post-order lists them in
+    // chain order.
+    void createChains(std::vector<Chain>& chains, Function &F) {
+      CE.compute(F);
+      std::vector<size_t> classChain(CE.getNumClasses(), ~size_t(0));
+      ReversePostOrderTraversal<Function *> RPOT(&F);
+      for(auto bb = RPOT.begin(), e = RPOT.end(); bb != e; ++bb) {
+        unsigned C = CE.getClass(*bb);
+        if(C == minreg::ControlEquivalence::NoClass)
+          continue;
+        if(classChain[C] == ~size_t(0)) {
+          classChain[C] = chains.size();
+          chains.push_back(Chain(*bb));
+          continue;
         }
+        Chain &chain = chains[classChain[C]];
+        assert(DT->dominates(chain[chain.size()-1], *bb) &&
+               PDT->dominates(*bb, chain[chain.size()-1]) &&
+               "Control-equivalent blocks out of order");
+        DEBUG(dbgs() << "Appending " << (*bb)->getName() << " to chain of "
+                     << chain[0]->getName() << "\n");
+        chain.append(*bb);
       }
     }
 
-    bool canMoveInst(Instruction &I, AliasSetTracker &AST) {
-      if (LoadInst *LI = dyn_cast<LoadInst>(&I)) {
-        if (!LI->isUnordered())
-          return false; // Don't hoist volatile/atomic loads!
-
-        // Loads from constant memory are always safe to move, even if they end up
-        // in the same alias set as something that ends up being modified.
-        if (AA->pointsToConstantMemory(LI->getOperand(0)))
-          return true;
-        if (LI->getMetadata(LLVMContext::MD_invariant_load))
-          return true;
-
-        // Don't move loads that may have been written to between
-        uint64_t Size = 0;
-        if (LI->getType()->isSized())
-          Size = I.getModule()->getDataLayout().getTypeStoreSize(LI->getType());
-
-        AAMDNodes AAInfo;
-        LI->getAAMetadata(AAInfo);
-
-        return !AST.getAliasSetForPointer(&I, Size, AAInfo).isMod();
+    bool canMoveInst(Instruction &I) {
+      if (LoadInst *LI = dyn_cast<LoadInst>(&I))
+        return LI->isUnordered(); // Don't move volatile/atomic loads!
+
+      if (CallInst *CI = dyn_cast<CallInst>(&I)) {
+        // Calls that neither write memory nor unwind can move like loads.
+        // Convergent calls must stay under their own control flow.
+        if (isa<DbgInfoIntrinsic>(CI) || CI->isInlineAsm() ||
+            CI->isConvergent() || !CI->doesNotThrow())
+          return false;
+        FunctionModRefBehavior MRB = AA->getModRefBehavior(ImmutableCallSite(CI));
+        return AAResults::onlyReadsMemory(MRB);
       }
-      // TODO: Handle call instructions
 
       if (!isa<BinaryOperator>(I) && !isa<CastInst>(I) && !isa<SelectInst>(I) &&
           !isa<GetElementPtrInst>(I) && !isa<CmpInst>(I) &&
@@ -190,87 +196,546 @@ namespace {
       return true;
     }
 
-    void getMovableUses(std::vector<User*>& uses, BasicBlock *fromBB, BasicBlock *toBB, AliasSetTracker& AST) {
-      assert(DT != nullptr);
-      bool didSomething = true;
-      while (didSomething) {
-        didSomething = false;
-        for(auto i = fromBB->begin(), e = fromBB->end(); i != e; ++i) {
-          // Ensure this instruction can be moved
-          if(!canMoveInst(*i, AST)) {
-            errs() << "Instruction cannot be moved:\n";
-            i->dump();
-            continue;
-          }
+    // Loads from constant memory are always safe to move
+    bool isInvariantLoad(LoadInst *LI) {
+      return AA->pointsToConstantMemory(LI->getPointerOperand()) ||
+             LI->getMetadata(LLVMContext::MD_invariant_load);
+    }
 
-          // Ensure that operands would be accessible/can be moved
-          bool opsValid = true;
-          for(auto op = i->op_begin(), e = i->op_end(); op != e; ++op) {
-            if(std::find(uses.begin(), uses.end(), op->get()) != uses.end())
-              continue; // Operand can be moved
-            if(Instruction * I = dyn_cast<Instruction>(op->get())) {
-              //
-              if(I->getParent() == toBB || DT->dominates(I, toBB))
-                continue; // Definition covers the target
-            } else {
-              continue; // Operand isn't an instruction, always safe
-            }
-            opsValid = false;
-          }
-          if (!opsValid)
-            continue;
+    // An instruction that reads memory may be hoisted to the end of toBB if
+    // whatever last wrote its memory is already in place there. Calls that
+    // do not touch memory have no access and move freely.
+    bool canHoistRead(Instruction *I, BasicBlock *toBB) {
+      LoadInst *LI = dyn_cast<LoadInst>(I);
+      if (LI && isInvariantLoad(LI))
+        return true;
+      MemoryUseOrDef *MA = MSSA->getMemoryAccess(I);
+      if (!MA)
+        return true;
+      if (!isa<MemoryUse>(MA))
+        return false;
+      MemoryAccess *Clobber = MSSA->getWalker()->getClobberingMemoryAccess(I);
+      return MSSA->isLiveOnEntryDef(Clobber) ||
+             DT->dominates(Clobber->getBlock(), toBB);
+    }
 
-          if (std::find(uses.begin(), uses.end(), &*i) == uses.end()) {
-            uses.push_back(&*i);
-            errs() << "Found Movement Candidate:\n";
-            i->dump();
-            didSomething = true;
-          }
+    // The memory state reaching the point just before I
+    MemoryAccess *getStateBefore(Instruction *I) {
+      BasicBlock *BB = I->getParent();
+      auto i = I->getIterator();
+      while (true) {
+        while (i != BB->begin()) {
+          --i;
+          MemoryUseOrDef *MA = MSSA->getMemoryAccess(&*i);
+          if (MA && isa<MemoryDef>(MA))
+            return MA;
         }
+        if (MemoryPhi *Phi = MSSA->getMemoryAccess(BB))
+          return Phi;
+        // Without a phi, all predecessors agree with the immediate dominator
+        DomTreeNode *IDom = DT->getNode(BB)->getIDom();
+        if (!IDom)
+          return MSSA->getLiveOnEntryDef();
+        BB = IDom->getBlock();
+        i = BB->end();
       }
     }
 
-    void raiseUses(Chain& chain) {
-      assert(AA != nullptr);
-      for(size_t i = chain.size()-1; i > 0; i--) {
+    // An instruction that reads memory may be sunk down to InsertPt if
+    // nothing in between clobbers it
+    bool canSinkRead(Instruction *I, Instruction *InsertPt) {
+      LoadInst *LI = dyn_cast<LoadInst>(I);
+      if (LI && isInvariantLoad(LI))
+        return true;
+      MemoryUseOrDef *MA = MSSA->getMemoryAccess(I);
+      if (!MA)
+        return true;
+      if (!isa<MemoryUse>(MA))
+        return false;
+      MemoryAccess *State = getStateBefore(InsertPt);
+      if (State == MA->getDefiningAccess())
+        return true;
+
+      if (LI) {
+        MemoryAccess *Clobber =
+          MSSA->getWalker()->getClobberingMemoryAccess(State, MemoryLocation::get(LI));
+        return MSSA->isLiveOnEntryDef(Clobber) || MSSA->dominates(Clobber, MA);
+      }
 
-        // Generate the AliasSet between these nodes in the chain
-        AliasSetTracker *AST = new AliasSetTracker(*AA);
-        const std::vector<BasicBlock *>& between = chain.blocksBetween(i-1);
-        for(auto bb = between.begin(), e = between.end(); bb != e; ++bb)
-          AST->add(**bb);
+      // A call has no single location to walk with, so check every write
+      // that may run between I and InsertPt instead. Only plain stores are
+      // understood.
+      ImmutableCallSite CS(I);
+      SmallVector<MemoryAccess *, 8> Worklist(1, State);
+      SmallPtrSet<MemoryAccess *, 8> Visited;
+      while (!Worklist.empty()) {
+        MemoryAccess *Cur = Worklist.pop_back_val();
+        if (!Visited.insert(Cur).second || MSSA->isLiveOnEntryDef(Cur) ||
+            MSSA->dominates(Cur, MA))
+          continue;
+        if (MemoryPhi *Phi = dyn_cast<MemoryPhi>(Cur)) {
+          for (unsigned n = 0, e = Phi->getNumIncomingValues(); n != e; ++n)
+            Worklist.push_back(Phi->getIncomingValue(n));
+          continue;
+        }
+        MemoryDef *Def = cast<MemoryDef>(Cur);
+        StoreInst *SI = dyn_cast<StoreInst>(Def->getMemoryInst());
+        if (!SI || (AA->getModRefInfo(CS, MemoryLocation::get(SI)) & MRI_Ref))
+          return false;
+        Worklist.push_back(Def->getDefiningAccess());
+      }
+      return true;
+    }
 
+    // Re-place the memory access of I after I itself has moved
+    void moveMemoryAccess(Instruction *I) {
+      MemoryUseOrDef *MA = MSSA->getMemoryAccess(I);
+      if (!MA)
+        return;
+      for (auto i = std::next(I->getIterator()), e = I->getParent()->end(); i != e; ++i) {
+        if (MemoryUseOrDef *Next = MSSA->getMemoryAccess(&*i)) {
+          MSSAU->moveBefore(MA, Next);
+          return;
+        }
+      }
+      MSSAU->moveToPlace(MA, I->getParent(), MemorySSA::End);
+    }
+
+    // Collect the instructions of fromBB that could be hoisted to the end of
+    // toBB, in dependency order. An instruction becomes a candidate once
+    // every operand it takes from fromBB is a candidate itself, so each
+    // instruction is visited once and its users are released through the
+    // def-use chains.
+    void getMovableUses(std::vector<Instruction *>& uses, BasicBlock *fromBB, BasicBlock *toBB) {
+      assert(DT != nullptr);
+      // Operands from fromBB that are not candidates yet
+      DenseMap<Instruction *, unsigned> pending;
+      std::vector<Instruction *> worklist;
+      for(auto i = fromBB->begin(), e = fromBB->end(); i != e; ++i) {
+        unsigned inBlock = 0;
+        bool opsValid = true;
+        for(auto op = i->op_begin(), e = i->op_end(); op != e; ++op) {
+          Instruction *I = dyn_cast<Instruction>(op->get());
+          if(!I)
+            continue; // Operand isn't an instruction, always safe
+          if(I->getParent() == fromBB)
+            ++inBlock; // Can move if its definition does
+          else if(I->getParent() != toBB && !DT->dominates(I, toBB))
+            opsValid = false; // Definition doesn't cover the target
+        }
+        if(!opsValid)
+          continue;
+        if(inBlock == 0)
+          worklist.push_back(&*i);
+        else
+          pending[&*i] = inBlock;
+      }
+
+      for(size_t w = 0; w != worklist.size(); ++w) {
+        Instruction *I = worklist[w];
+        if(!canMoveInst(*I) || !canHoistRead(I, toBB)) {
+          DEBUG(dbgs() << "Instruction cannot be moved: " << *I << "\n");
+          continue;
+        }
+        uses.push_back(I);
+        for(auto u = I->use_begin(), e = I->use_end(); u != e; ++u) {
+          auto p = pending.find(cast<Instruction>(u->getUser()));
+          if(p != pending.end() && --p->second == 0)
+            worklist.push_back(p->first);
+        }
+      }
+    }
+
+    // Values that can occupy a register
+    static bool isRegValue(Value *V) {
+      return isa<Instruction>(V) || isa<Argument>(V);
+    }
+
+    // Would hoisting I out of fromBB end the live range of Op across link
+    // i of the chain, i.e. is I the last use of Op below toBB?
+    bool endsRangeIfHoisted(Value *Op, Instruction *I, BasicBlock *fromBB,
+                            Chain &chain, size_t i) {
+      if (LQ.isLiveOut(Op, fromBB))
+        return false;
+      for (auto u = Op->use_begin(), e = Op->use_end(); u != e; ++u) {
+        Instruction *User = dyn_cast<Instruction>(u->getUser());
+        if (!User || User == I)
+          continue;
+        BasicBlock *UseBB = User->getParent();
+        if (PHINode *P = dyn_cast<PHINode>(User))
+          UseBB = P->getIncomingBlock(*u);
+        if (UseBB == fromBB || chain.isBetween(i, UseBB, *DT, *PDT))
+          return false;
+      }
+      return true;
+    }
+
+    MoveCost hoistCost(Instruction *I, BasicBlock *fromBB, Chain &chain, size_t i) {
+      const DataLayout &DL = I->getModule()->getDataLayout();
+      MoveCost Cost;
+      // The result is now live across the link
+      Cost.add(I, 1, DL);
+      SmallPtrSet<Value *, 4> Seen;
+      for (auto op = I->op_begin(), e = I->op_end(); op != e; ++op) {
+        Value *V = op->get();
+        if (isRegValue(V) && Seen.insert(V).second &&
+            endsRangeIfHoisted(V, I, fromBB, chain, i))
+          Cost.add(V, -1, DL);
+      }
+      return Cost;
+    }
+
+    MoveCost sinkCost(Instruction *I, BasicBlock *fromBB) {
+      const DataLayout &DL = I->getModule()->getDataLayout();
+      MoveCost Cost;
+      // The result no longer crosses the link
+      Cost.add(I, -1, DL);
+      SmallPtrSet<Value *, 4> Seen;
+      for (auto op = I->op_begin(), e = I->op_end(); op != e; ++op) {
+        Value *V = op->get();
+        if (isRegValue(V) && Seen.insert(V).second && !LQ.isLiveIn(V, fromBB))
+          Cost.add(V, 1, DL);
+      }
+      return Cost;
+    }
+
+    // Hoist candidates from chain[i+1] to the end of chain[i] when doing so
+    // shortens more live ranges across the link than it lengthens.
+    bool hoistUses(std::vector<Instruction *>& uses, Chain &chain, size_t i) {
+      BasicBlock *fromBB = chain[i+1], *toBB = chain[i];
+      bool moved = false;
+      for(auto u = uses.begin(), e = uses.end(); u != e; ++u) {
+        Instruction *I = *u;
+        if (I->use_empty())
+          continue;
+
+        // Candidates were collected assuming their in-block operands move
+        // too, which only holds if those were hoisted already.
+        bool opsAvailable = true;
+        for(auto op = I->op_begin(), e = I->op_end(); op != e; ++op)
+          if (Instruction *OpI = dyn_cast<Instruction>(op->get()))
+            opsAvailable &= OpI->getParent() != fromBB;
+        if (!opsAvailable)
+          continue;
+
+        MoveCost Cost = hoistCost(I, fromBB, chain, i);
+        if (!Cost.isProfitable())
+          continue;
+
+        DEBUG(dbgs() << "Hoisting to " << toBB->getName() << " (units "
+                     << Cost.Units << ", preds " << Cost.Preds << "): " << *I << "\n");
+        ORE->emit(OptimizationRemark(DEBUG_TYPE, "Hoisted", I)
+                  << "hoisted to " << ore::NV("Block", toBB->getName())
+                  << ", register units " << ore::NV("Units", Cost.Units)
+                  << ", predicates " << ore::NV("Preds", Cost.Preds));
+        I->moveBefore(toBB->getTerminator());
+        moveMemoryAccess(I);
+        ++NumHoisted;
+        if (I->mayReadFromMemory())
+          ++NumMemHoisted;
+        moved = true;
+      }
+      return moved;
+    }
+
+    // The first instruction in BB that uses I, if all of I's users are
+    // ordinary instructions in BB.
+    static Instruction *getOnlyBlockUser(Instruction *I, BasicBlock *BB) {
+      SmallPtrSet<Instruction *, 8> Users;
+      for (auto u = I->user_begin(), e = I->user_end(); u != e; ++u) {
+        Instruction *User = dyn_cast<Instruction>(*u);
+        if (!User || User->getParent() != BB || isa<PHINode>(User))
+          return nullptr;
+        Users.insert(User);
+      }
+      for (auto i = BB->begin(), e = BB->end(); i != e; ++i)
+        if (Users.count(&*i))
+          return &*i;
+      return nullptr;
+    }
+
+    // Sink instructions of chain[i-1] whose only users are in chain[i] down
+    // to their first user, when that frees registers across the link.
+    bool sinkDefs(BasicBlock *fromBB, BasicBlock *toBB) {
+      bool moved = false;
+      // Bottom-up, so that users sink before their operands are considered
+      for (auto i = toBB->rbegin(), e = toBB->rend(); i != e;) {
+        Instruction *I = &*i;
+        ++i;
+        if (I->use_empty() || !canMoveInst(*I))
+          continue;
+        Instruction *InsertPt = getOnlyBlockUser(I, fromBB);
+        if (!InsertPt)
+          continue;
+        if (!canSinkRead(I, InsertPt))
+          continue;
+
+        MoveCost Cost = sinkCost(I, fromBB);
+        if (!Cost.isProfitable())
+          continue;
+
+        DEBUG(dbgs() << "Sinking to " << fromBB->getName() << " (units "
+                     << Cost.Units << ", preds " << Cost.Preds << "): " << *I << "\n");
+        ORE->emit(OptimizationRemark(DEBUG_TYPE, "Sunk", I)
+                  << "sunk to " << ore::NV("Block", fromBB->getName())
+                  << ", register units " << ore::NV("Units", Cost.Units)
+                  << ", predicates " << ore::NV("Preds", Cost.Preds));
+        I->moveBefore(InsertPt);
+        moveMemoryAccess(I);
+        ++NumSunk;
+        if (I->mayReadFromMemory())
+          ++NumMemSunk;
+        moved = true;
+      }
+      return moved;
+    }
+
+    bool raiseUses(Chain& chain) {
+      assert(MSSA != nullptr);
+      bool moved = false;
+      for(size_t i = chain.size()-1; i > 0; i--) {
         // Generate the set of movable uses
-        std::vector<User *> uses;
-        getMovableUses(uses, chain[i], chain[i-1], *AST);
-
-        errs() << "Candidates from " << chain[i]->getName()
-          << " to " << chain[i-1]->getName() << ":\n";
-        errs() << "(Through ";
-        for(auto b = chain.blocksBetween(i-1).begin(), e = chain.blocksBetween(i-1).end(); b != e; ++b)
-          errs() << (*b)->getName() << " ";
-        errs() << ")\n";
-        for(auto u = uses.begin(), e = uses.end(); u != e; ++u)
-          (*u)->dump();
+        std::vector<Instruction *> uses;
+        getMovableUses(uses, chain[i], chain[i-1]);
+
+        DEBUG({
+          dbgs() << "Candidates from " << chain[i]->getName() << " to "
+                 << chain[i-1]->getName() << " (through";
+          Function *F = chain[i]->getParent();
+          for(auto b = F->begin(), e = F->end(); b != e; ++b)
+            if(chain.isBetween(i-1, &*b, *DT, *PDT))
+              dbgs() << " " << b->getName();
+          dbgs() << "):\n";
+          for(auto u = uses.begin(), e = uses.end(); u != e; ++u)
+            dbgs() << **u << "\n";
+        });
+
+        moved |= hoistUses(uses, chain, i-1);
+        moved |= sinkDefs(chain[i], chain[i-1]);
       }
+      return moved;
     }
 
-    bool runOnFunction(Function &F) override {
-      AA = &getAnalysis<AAResultsWrapperPass>().getAAResults();
-      DT = &getAnalysis<DominatorTreeWrapperPass>().getDomTree();
-      PDT = &getAnalysis<PostDominatorTreeWrapperPass>().getPostDomTree();
+    // Cheap to recompute, and safe wherever its operands are available
+    static bool isRematerializable(Instruction *I) {
+      if (BinaryOperator *BO = dyn_cast<BinaryOperator>(I)) {
+        switch (BO->getOpcode()) {
+        case Instruction::UDiv: case Instruction::SDiv: case Instruction::FDiv:
+        case Instruction::URem: case Instruction::SRem: case Instruction::FRem:
+          return false;
+        default:
+          return true;
+        }
+      }
+      return isa<CastInst>(I) || isa<GetElementPtrInst>(I) || isa<CmpInst>(I) ||
+             isa<SelectInst>(I) || isa<ExtractValueInst>(I);
+    }
 
-      F.viewCFG();
-      std::vector<Chain> chains;
-      createChains(chains, &F.getEntryBlock());
+    // Is V available at the top of BB (AtEnd false) or at its end, without
+    // extending its live range?
+    bool isAvailable(Value *V, BasicBlock *BB, bool AtEnd) {
+      if (!isRegValue(V))
+        return true;
+      if (!AtEnd)
+        return LQ.isLiveIn(V, BB);
+      Instruction *VI = dyn_cast<Instruction>(V);
+      return (VI && VI->getParent() == BB) || LQ.isLiveOut(V, BB);
+    }
 
-      // Discard trivial chains
-      auto endChains = std::remove_if(chains.begin(), chains.end(), Chain::singleElem);
+    // Try to recompute I in every other block that uses it, so that it no
+    // longer lives beyond its own block. Each copy goes before the first
+    // user in its block, or at the end for PHI operands.
+    bool rematerialize(Instruction *I) {
+      BasicBlock *DefBB = I->getParent();
+      SmallVector<BasicBlock *, 4> Blocks;
+      DenseMap<BasicBlock *, SmallVector<Use *, 4>> UsesIn;
+      DenseMap<BasicBlock *, bool> OnlyAtEnd;
+      for (auto u = I->use_begin(), e = I->use_end(); u != e; ++u) {
+        Instruction *User = cast<Instruction>(u->getUser());
+        PHINode *P = dyn_cast<PHINode>(User);
+        BasicBlock *UseBB = P ? P->getIncomingBlock(*u) : User->getParent();
+        if (UseBB == DefBB)
+          continue;
+        if (!UsesIn.count(UseBB)) {
+          Blocks.push_back(UseBB);
+          OnlyAtEnd[UseBB] = true;
+        }
+        UsesIn[UseBB].push_back(&*u);
+        if (!P)
+          OnlyAtEnd[UseBB] = false;
+      }
+      if (Blocks.empty() || Blocks.size() > RematMaxClones)
+        return false;
+
+      for (auto bb = Blocks.begin(), e = Blocks.end(); bb != e; ++bb)
+        for (auto op = I->op_begin(), oe = I->op_end(); op != oe; ++op)
+          if (!isAvailable(op->get(), *bb, OnlyAtEnd[*bb]))
+            return false;
+
+      for (auto bb = Blocks.begin(), e = Blocks.end(); bb != e; ++bb) {
+        SmallVectorImpl<Use *> &Uses = UsesIn[*bb];
+        Instruction *InsertPt = (*bb)->getTerminator();
+        if (!OnlyAtEnd[*bb]) {
+          SmallPtrSet<Instruction *, 4> Users;
+          for (auto u = Uses.begin(), ue = Uses.end(); u != ue; ++u)
+            Users.insert(cast<Instruction>((*u)->getUser()));
+          for (auto i = (*bb)->begin(), ie = (*bb)->end(); i != ie; ++i)
+            if (!isa<PHINode>(&*i) && Users.count(&*i)) {
+              InsertPt = &*i;
+              break;
+            }
+        }
+        Instruction *Copy = I->clone();
+        Copy->setName(I->getName() + ".remat");
+        Copy->insertBefore(InsertPt);
+        for (auto u = Uses.begin(), ue = Uses.end(); u != ue; ++u)
+          (*u)->set(Copy);
+        ++NumRematClones;
+      }
+
+      ORE->emit(OptimizationRemark(DEBUG_TYPE, "Rematerialized", I)
+                << "recomputed in " << ore::NV("Blocks", (unsigned)Blocks.size())
+                << " blocks instead of keeping it live");
+      ++NumRemat;
+      if (I->use_empty())
+        I->eraseFromParent();
+      return true;
+    }
+
+    // Rematerialize values that are live into the most crowded blocks
+    bool rematerializeValues(Function &F) {
+      minreg::Liveness Live;
+      minreg::RegisterPressure RP;
+      Live.compute(F);
+      RP.compute(F, Live);
+      unsigned Threshold = RematPressure ? (unsigned)RematPressure : RP.getMaxPressure();
+      SmallVector<BasicBlock *, 8> Hot;
+      for (auto bb = F.begin(), e = F.end(); bb != e; ++bb)
+        if (RP.getBlockMax(&*bb).total() >= Threshold)
+          Hot.push_back(&*bb);
+
+      std::vector<Instruction *> Candidates;
+      for (auto bb = F.begin(), e = F.end(); bb != e; ++bb) {
+        for (auto i = bb->begin(), ie = bb->end(); i != ie; ++i) {
+          if (!isRematerializable(&*i) || !Live.isTracked(&*i))
+            continue;
+          for (auto h = Hot.begin(), he = Hot.end(); h != he; ++h) {
+            if (Live.isLiveIn(&*i, *h)) {
+              Candidates.push_back(&*i);
+              break;
+            }
+          }
+        }
+      }
+
+      bool changed = false;
+      for (auto c = Candidates.begin(), e = Candidates.end(); c != e; ++c)
+        changed |= rematerialize(*c);
+      return changed;
+    }
+
+    // Reorder each block internally, after cross-block motion has settled
+    // which instructions it holds.
+    bool scheduleBlocks(Function &F) {
+      minreg::BlockScheduler Sched(*AA, LQ, F.getParent()->getDataLayout(),
+                                   SchedPreciseLimit);
+      bool changed = false;
+      for (auto bb = F.begin(), e = F.end(); bb != e; ++bb) {
+        if (!Sched.schedule(*bb))
+          continue;
+        // Writes keep their order, so only reads need re-placing; bottom-up,
+        // so that the access each one is placed before is already in place
+        for (auto i = bb->rbegin(), ie = bb->rend(); i != ie; ++i)
+          if (MemoryUseOrDef *MA = MSSA->getMemoryAccess(&*i))
+            if (isa<MemoryUse>(MA))
+              moveMemoryAccess(&*i);
+
+        ORE->emit(OptimizationRemark(DEBUG_TYPE, "Scheduled", &*bb->getFirstInsertionPt())
+                  << "reordered block " << ore::NV("Block", bb->getName())
+                  << ", peak register units " << ore::NV("Before", Sched.getPeakBefore())
+                  << " -> " << ore::NV("After", Sched.getPeakAfter()));
+        ++NumScheduled;
+        changed = true;
+      }
+      return changed;
+    }
+
+    bool run(Function &F, AliasAnalysis &AAR, DominatorTree &DTR,
+             PostDominatorTree &PDTR, LoopInfo &LI, MemorySSA &MSSAR,
+             OptimizationRemarkEmitter &ORER) {
+      AA = &AAR;
+      DT = &DTR;
+      PDT = &PDTR;
+      MSSA = &MSSAR;
+      ORE = &ORER;
+      {
+        instr::PhaseTimer T("liveness", "minreg");
+        LQ.compute(F, *DT, LI);
+      }
+      // Memory SSA is shared by all links and kept current as loads move
+      MemorySSAUpdater Updater(MSSA);
+      MSSAU = &Updater;
+
+      std::vector<Chain> chains;
+      std::vector<Chain>::iterator endChains;
+      {
+        instr::PhaseTimer T("chains", "minreg");
+        createChains(chains, F);
+
+        // Discard trivial chains
+        endChains = std::remove_if(chains.begin(), chains.end(), Chain::singleElem);
+        // Numbered once, so that Chain::isBetween is constant time
+        DT->updateDFSNumbers();
+        PDT->updateDFSNumbers();
+        NumChains += endChains - chains.begin();
+      }
       // Raise Uses
-      for(auto c = chains.begin(); c != endChains; ++c)
-        raiseUses(*c);
+      bool changed = false;
+      {
+        instr::PhaseTimer T("motion", "minreg");
+        for(auto c = chains.begin(); c != endChains; ++c)
+          changed |= raiseUses(*c);
+      }
+      if (Rematerialize) {
+        instr::PhaseTimer T("remat", "minreg");
+        changed |= rematerializeValues(F);
+      }
+      if (ScheduleBlocks) {
+        instr::PhaseTimer T("schedule", "minreg");
+        changed |= scheduleBlocks(F);
+      }
+
+      MSSAU = nullptr;
+      LQ.clear();
+      CE.clear();
+      return changed;
+    }
+  };
+
+  struct MinReg : public FunctionPass {
+    static char ID;
+    MinReg() : FunctionPass(ID) {}
 
-      return false;
+    void getAnalysisUsage(AnalysisUsage& AU) const override {
+      AU.addRequired<DominatorTreeWrapperPass>();
+      AU.addRequired<PostDominatorTreeWrapperPass>();
+      AU.addRequired<LoopInfoWrapperPass>();
+      AU.addRequired<AAResultsWrapperPass>();
+      AU.addRequired<MemorySSAWrapperPass>();
+      AU.addPreserved<MemorySSAWrapperPass>();
+      AU.addRequired<OptimizationRemarkEmitterWrapperPass>();
+      // Instructions only move between existing blocks
+      AU.setPreservesCFG();
+    }
+
+    bool runOnFunction(Function &F) override {
+      MinRegImpl Impl;
+      return Impl.run(F, getAnalysis<AAResultsWrapperPass>().getAAResults(),
+                      getAnalysis<DominatorTreeWrapperPass>().getDomTree(),
+                      getAnalysis<PostDominatorTreeWrapperPass>().getPostDomTree(),
+                      getAnalysis<LoopInfoWrapperPass>().getLoopInfo(),
+                      getAnalysis<MemorySSAWrapperPass>().getMSSA(),
+                      getAnalysis<OptimizationRemarkEmitterWrapperPass>().getORE());
     }
   };
 }
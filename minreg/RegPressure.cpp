@@ -0,0 +1,141 @@
+#include "minreg/RegPressure.h"
+#include "minreg/Liveness.h"
+
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Type.h"
+
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+
+using namespace llvm;
+using namespace minreg;
+
+RegClass minreg::getRegClass(Type *Ty) {
+  if (Ty->isVectorTy())
+    return RC_Vector;
+  if (Ty->isIntegerTy(1))
+    return RC_Pred;
+  if (Ty->isIntegerTy())
+    return Ty->getIntegerBitWidth() <= 32 ? RC_Int32 : RC_Int64;
+  if (Ty->isPointerTy())
+    return RC_Int64;
+  if (Ty->isFloatingPointTy())
+    return RC_Float;
+  return RC_Other;
+}
+
+const char *minreg::getRegClassName(RegClass RC) {
+  switch (RC) {
+  case RC_Pred:   return "pred";
+  case RC_Int32:  return "i32";
+  case RC_Int64:  return "i64";
+  case RC_Float:  return "fp";
+  case RC_Vector: return "vec";
+  case RC_Other:  return "other";
+  default:        break;
+  }
+  llvm_unreachable("Unknown register class");
+}
+
+unsigned minreg::getRegUnits(Type *Ty, const DataLayout &DL) {
+  if (!Ty->isSized())
+    return 1;
+  uint64_t Bits = DL.getTypeSizeInBits(Ty);
+  return std::max<uint64_t>(1, (Bits + 31) / 32);
+}
+
+void Pressure::print(raw_ostream &OS) const {
+  OS << total() << " (";
+  for (unsigned rc = 0; rc < RC_NumClasses; ++rc)
+    OS << (rc ? " " : "") << getRegClassName((RegClass)rc) << "=" << Count[rc];
+  OS << ")";
+}
+
+void RegisterPressure::clear() {
+  AtInst.clear();
+  BlockMax.clear();
+  BlockMaxTotal.clear();
+  PeakBlocks.clear();
+  MaxByClass = Pressure();
+  MaxTotal = 0;
+}
+
+const Pressure &RegisterPressure::getPressureAt(const Instruction *I) const {
+  auto it = AtInst.find(I);
+  assert(it != AtInst.end() && "No pressure recorded for instruction");
+  return it->second;
+}
+
+const Pressure &RegisterPressure::getBlockMax(const BasicBlock *BB) const {
+  auto it = BlockMax.find(BB);
+  assert(it != BlockMax.end() && "No pressure recorded for block");
+  return it->second;
+}
+
+void RegisterPressure::compute(Function &F, const Liveness &Live) {
+  clear();
+
+  for (auto bb = F.begin(), e = F.end(); bb != e; ++bb) {
+    Liveness::ValueSet Cur = Live.getLiveOut(&*bb);
+    Pressure P;
+    for (auto n = Cur.begin(), e = Cur.end(); n != e; ++n)
+      P.Count[getRegClass(Live.getValue(*n)->getType())]++;
+
+    Pressure Max;
+    unsigned MaxTot = 0;
+    auto record = [&](const Instruction *I, const Pressure &At) {
+      AtInst[I] = At;
+      Max.merge(At);
+      MaxTot = std::max(MaxTot, At.total());
+    };
+
+    // Walk the non-PHI instructions bottom-up
+    for (auto i = bb->rbegin(), e = bb->rend(); i != e; ++i) {
+      Instruction *I = &*i;
+      if (isa<PHINode>(I))
+        break;
+
+      Pressure At = P;
+      bool Tracked = Live.isTracked(I);
+      unsigned N = Tracked ? Live.getValueNumber(I) : 0;
+      RegClass RC = getRegClass(I->getType());
+      if (Tracked && !Cur.test(N))
+        At.Count[RC]++; // Result is dead but still needs a register
+      record(I, At);
+
+      if (Tracked && Cur.test(N)) {
+        Cur.reset(N);
+        P.Count[RC]--;
+      }
+      for (auto op = I->op_begin(), e = I->op_end(); op != e; ++op) {
+        if (!Live.isTracked(op->get()))
+          continue;
+        unsigned OpN = Live.getValueNumber(op->get());
+        if (!Cur.test(OpN)) {
+          Cur.set(OpN);
+          P.Count[getRegClass(op->get()->getType())]++;
+        }
+      }
+    }
+
+    // Every PHI defines at block entry, so they share one pressure
+    Pressure Entry = P;
+    for (auto i = bb->begin(); isa<PHINode>(i); ++i)
+      if (!Cur.test(Live.getValueNumber(&*i)))
+        Entry.Count[getRegClass(i->getType())]++;
+    for (auto i = bb->begin(); isa<PHINode>(i); ++i)
+      record(&*i, Entry);
+
+    BlockMax[&*bb] = Max;
+    BlockMaxTotal[&*bb] = MaxTot;
+    MaxByClass.merge(Max);
+    MaxTotal = std::max(MaxTotal, MaxTot);
+  }
+
+  for (auto bb = F.begin(), e = F.end(); bb != e; ++bb)
+    if (BlockMaxTotal[&*bb] == MaxTotal)
+      PeakBlocks.push_back(&*bb);
+}
@@ -0,0 +1,93 @@
+#ifndef MINREG_REGPRESSURE_H
+#define MINREG_REGPRESSURE_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+
+namespace llvm {
+  class BasicBlock;
+  class DataLayout;
+  class Function;
+  class Instruction;
+  class Type;
+  class raw_ostream;
+}
+
+namespace minreg {
+  class Liveness;
+
+  // Coarse register classes that values are counted against
+  enum RegClass {
+    RC_Pred,   // i1
+    RC_Int32,  // integers up to 32 bits
+    RC_Int64,  // wider integers and pointers
+    RC_Float,  // scalar floating point
+    RC_Vector, // any vector type
+    RC_Other,  // aggregates and anything else
+    RC_NumClasses
+  };
+
+  RegClass getRegClass(llvm::Type *Ty);
+  const char *getRegClassName(RegClass RC);
+  // Number of 32-bit registers a value of type Ty occupies
+  unsigned getRegUnits(llvm::Type *Ty, const llvm::DataLayout &DL);
+
+  // Number of simultaneously live values, split by register class
+  struct Pressure {
+    unsigned Count[RC_NumClasses];
+
+    Pressure() {
+      for (unsigned rc = 0; rc < RC_NumClasses; ++rc)
+        Count[rc] = 0;
+    }
+
+    unsigned total() const {
+      unsigned Sum = 0;
+      for (unsigned rc = 0; rc < RC_NumClasses; ++rc)
+        Sum += Count[rc];
+      return Sum;
+    }
+
+    // Element-wise maximum
+    void merge(const Pressure &Other) {
+      for (unsigned rc = 0; rc < RC_NumClasses; ++rc)
+        if (Other.Count[rc] > Count[rc])
+          Count[rc] = Other.Count[rc];
+    }
+
+    void print(llvm::raw_ostream &OS) const;
+  };
+
+  // Register pressure at every program point of a function, derived from
+  // block liveness. The pressure at an instruction counts the values live
+  // immediately after it, plus its own result even if that is never used.
+  // PHIs all define at block entry and share the block-entry pressure.
+  class RegisterPressure {
+  public:
+    void compute(llvm::Function &F, const Liveness &Live);
+    void clear();
+
+    const Pressure &getPressureAt(const llvm::Instruction *I) const;
+    const Pressure &getBlockMax(const llvm::BasicBlock *BB) const;
+
+    // Highest total over all program points, and the per-class maxima
+    // (which need not occur at the same point).
+    unsigned getMaxPressure() const { return MaxTotal; }
+    const Pressure &getMaxByClass() const { return MaxByClass; }
+
+    // Blocks containing a program point at the function-wide peak
+    const llvm::SmallVectorImpl<llvm::BasicBlock *> &getPeakBlocks() const {
+      return PeakBlocks;
+    }
+
+  private:
+    llvm::DenseMap<const llvm::Instruction *, Pressure> AtInst;
+    llvm::DenseMap<const llvm::BasicBlock *, Pressure> BlockMax;
+    llvm::DenseMap<const llvm::BasicBlock *, unsigned> BlockMaxTotal;
+    llvm::SmallVector<llvm::BasicBlock *, 4> PeakBlocks;
+    Pressure MaxByClass;
+    unsigned MaxTotal = 0;
+  };
+}
+
+#endif
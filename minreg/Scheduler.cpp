@@ -0,0 +1,301 @@
+#include "minreg/Scheduler.h"
+#include "minreg/LiveQuery.h"
+#include "minreg/RegPressure.h"
+
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/MemoryLocation.h"
+#include "llvm/Analysis/ValueTracking.h"
+
+#include "llvm/IR/CallSite.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+
+#include <algorithm>
+#include <queue>
+#include <utility>
+
+using namespace llvm;
+using namespace minreg;
+
+// Values that can occupy a register
+static bool isRegValue(Value *V) {
+  return (isa<Instruction>(V) || isa<Argument>(V)) && !V->getType()->isVoidTy();
+}
+
+// Instructions whose relative order is kept as written
+static bool isOrdered(Instruction *I) {
+  return I->mayHaveSideEffects() || isa<AllocaInst>(I);
+}
+
+// Instructions that may only move between the ordered instructions they
+// do not conflict with
+static bool isPinned(Instruction *I) {
+  return I->mayReadFromMemory() || !isSafeToSpeculativelyExecute(I);
+}
+
+unsigned BlockScheduler::getUnits(Value *V) const {
+  return isRegValue(V) ? getRegUnits(V->getType(), DL) : 0;
+}
+
+void BlockScheduler::addEdge(unsigned From, unsigned To) {
+  Nodes[From].Succs.push_back(To);
+  Nodes[To].Preds.push_back(From);
+}
+
+// Can pinned instruction R not cross ordered instruction W?
+bool BlockScheduler::conflicts(Instruction *W, Instruction *R) {
+  // Calls may not return, and nothing crosses a possible exit
+  if (isa<CallInst>(W) || isa<InvokeInst>(W) || W->mayThrow())
+    return true;
+  if (!R->mayReadFromMemory())
+    return false;
+  if (LoadInst *LI = dyn_cast<LoadInst>(R))
+    return AA.getModRefInfo(W, MemoryLocation::get(LI)) & MRI_Mod;
+  // A read-only call has no single location; only plain stores it cannot
+  // read from are understood.
+  StoreInst *SI = dyn_cast<StoreInst>(W);
+  return !SI || (AA.getModRefInfo(ImmutableCallSite(R), MemoryLocation::get(SI)) & MRI_Ref);
+}
+
+void BlockScheduler::buildDAG(bool Precise) {
+  std::vector<unsigned> Ordered;
+  for (unsigned n = 0, e = Nodes.size(); n != e; ++n) {
+    Instruction *I = Nodes[n].I;
+    for (auto op = I->op_begin(), oe = I->op_end(); op != oe; ++op) {
+      Instruction *OpI = dyn_cast<Instruction>(op->get());
+      if (!OpI || !Index.count(OpI))
+        continue;
+      unsigned P = Index[OpI];
+      if (std::find(Nodes[n].Operands.begin(), Nodes[n].Operands.end(), P) ==
+          Nodes[n].Operands.end()) {
+        Nodes[n].Operands.push_back(P);
+        addEdge(P, n);
+      }
+    }
+    if (isOrdered(I)) {
+      if (!Ordered.empty())
+        addEdge(Ordered.back(), n);
+      Ordered.push_back(n);
+    }
+  }
+
+  // Pinned instructions depend on the nearest conflicting ordered
+  // instruction on either side; the chain of ordered instructions covers
+  // the rest. Without alias analysis the nearest one is taken.
+  for (unsigned n = 0, e = Nodes.size(); n != e; ++n) {
+    Instruction *I = Nodes[n].I;
+    if (isOrdered(I) || !isPinned(I))
+      continue;
+    auto Next = std::lower_bound(Ordered.begin(), Ordered.end(), n);
+    for (auto o = Next; o != Ordered.begin();) {
+      --o;
+      if (!Precise || conflicts(Nodes[*o].I, I)) {
+        addEdge(*o, n);
+        break;
+      }
+    }
+    for (auto o = Next; o != Ordered.end(); ++o) {
+      if (!Precise || conflicts(Nodes[*o].I, I)) {
+        addEdge(n, *o);
+        break;
+      }
+    }
+  }
+
+  for (auto N = Nodes.begin(), E = Nodes.end(); N != E; ++N)
+    N->SuccsLeft = N->Succs.size();
+}
+
+// Registers needed to evaluate each instruction's in-block operand tree,
+// largest subtree first. Operands always precede their users, so one pass
+// in program order suffices.
+void BlockScheduler::computeNeeds() {
+  for (auto N = Nodes.begin(), E = Nodes.end(); N != E; ++N) {
+    SmallVector<unsigned, 4> Ops(N->Operands.begin(), N->Operands.end());
+    std::sort(Ops.begin(), Ops.end(), [&](unsigned A, unsigned B) {
+      return Nodes[A].Need > Nodes[B].Need;
+    });
+    unsigned Need = getUnits(N->I), Held = 0;
+    for (auto o = Ops.begin(), oe = Ops.end(); o != oe; ++o) {
+      Need = std::max(Need, Nodes[*o].Need + Held);
+      Held += getUnits(Nodes[*o].I);
+    }
+    N->Need = Need;
+  }
+}
+
+// Values live at the bottom of the scheduled region: those live out of the
+// block, and the operands of the terminator.
+void BlockScheduler::initLiveOut() {
+  LiveOut.clear();
+  for (auto i = BB->begin(), e = BB->end(); i != e; ++i) {
+    if (isRegValue(&*i) && LQ.isLiveOut(&*i, BB))
+      LiveOut.insert(&*i);
+    for (auto op = i->op_begin(), oe = i->op_end(); op != oe; ++op)
+      if (isRegValue(op->get()) && LQ.isLiveOut(op->get(), BB))
+        LiveOut.insert(op->get());
+  }
+  Instruction *Term = BB->getTerminator();
+  for (auto op = Term->op_begin(), oe = Term->op_end(); op != oe; ++op)
+    if (isRegValue(op->get()))
+      LiveOut.insert(op->get());
+}
+
+// Change in live register units from scheduling N next, bottom-up: its
+// result dies above it and its operands become live.
+int BlockScheduler::getDelta(unsigned N, const LiveSet &Live) const {
+  Instruction *I = Nodes[N].I;
+  int Delta = Live.count(I) ? -(int)getUnits(I) : 0;
+  for (auto op = I->op_begin(), oe = I->op_end(); op != oe; ++op) {
+    Value *V = op->get();
+    if (!isRegValue(V) || Live.count(V))
+      continue;
+    bool Seen = false;
+    for (auto prev = I->op_begin(); prev != op && !Seen; ++prev)
+      Seen = prev->get() == V;
+    if (!Seen)
+      Delta += getUnits(V);
+  }
+  return Delta;
+}
+
+void BlockScheduler::scheduleByPressure(std::vector<unsigned> &Order) {
+  LiveSet Live(LiveOut);
+  std::vector<unsigned> Ready;
+  for (unsigned n = 0, e = Nodes.size(); n != e; ++n)
+    if (Nodes[n].SuccsLeft == 0)
+      Ready.push_back(n);
+
+  while (!Ready.empty()) {
+    auto Best = Ready.begin();
+    int BestDelta = getDelta(*Best, Live);
+    for (auto r = std::next(Ready.begin()), e = Ready.end(); r != e; ++r) {
+      int Delta = getDelta(*r, Live);
+      const Node &N = Nodes[*r], &B = Nodes[*Best];
+      if (Delta < BestDelta ||
+          (Delta == BestDelta &&
+           (N.Need < B.Need || (N.Need == B.Need && *r > *Best)))) {
+        Best = r;
+        BestDelta = Delta;
+      }
+    }
+    unsigned N = *Best;
+    Ready.erase(Best);
+    Order.push_back(N);
+
+    Instruction *I = Nodes[N].I;
+    Live.erase(I);
+    for (auto op = I->op_begin(), oe = I->op_end(); op != oe; ++op)
+      if (isRegValue(op->get()))
+        Live.insert(op->get());
+    for (auto p = Nodes[N].Preds.begin(), pe = Nodes[N].Preds.end(); p != pe; ++p)
+      if (--Nodes[*p].SuccsLeft == 0)
+        Ready.push_back(*p);
+  }
+  std::reverse(Order.begin(), Order.end());
+}
+
+void BlockScheduler::scheduleByPriority(std::vector<unsigned> &Order) {
+  // Bottom-up, smallest subtrees first so that the largest are evaluated
+  // first in program order; later instructions first among equals.
+  auto Later = [&](unsigned A, unsigned B) {
+    if (Nodes[A].Need != Nodes[B].Need)
+      return Nodes[A].Need > Nodes[B].Need;
+    return A < B;
+  };
+  std::priority_queue<unsigned, std::vector<unsigned>, decltype(Later)> Ready(Later);
+  for (unsigned n = 0, e = Nodes.size(); n != e; ++n)
+    if (Nodes[n].SuccsLeft == 0)
+      Ready.push(n);
+
+  while (!Ready.empty()) {
+    unsigned N = Ready.top();
+    Ready.pop();
+    Order.push_back(N);
+    for (auto p = Nodes[N].Preds.begin(), pe = Nodes[N].Preds.end(); p != pe; ++p)
+      if (--Nodes[*p].SuccsLeft == 0)
+        Ready.push(*p);
+  }
+  std::reverse(Order.begin(), Order.end());
+}
+
+// Highest number of live register units at any instruction of the region,
+// counting each instruction's own result while it is defined.
+unsigned BlockScheduler::getPeak(const std::vector<unsigned> &Order) {
+  LiveSet Live(LiveOut);
+  unsigned Cur = 0;
+  for (auto v = Live.begin(), e = Live.end(); v != e; ++v)
+    Cur += getUnits(*v);
+  unsigned Peak = Cur;
+  for (auto n = Order.rbegin(), e = Order.rend(); n != e; ++n) {
+    Instruction *I = Nodes[*n].I;
+    Peak = std::max(Peak, Cur + (Live.count(I) ? 0 : getUnits(I)));
+    if (Live.erase(I))
+      Cur -= getUnits(I);
+    for (auto op = I->op_begin(), oe = I->op_end(); op != oe; ++op)
+      if (isRegValue(op->get()) && Live.insert(op->get()).second)
+        Cur += getUnits(op->get());
+    Peak = std::max(Peak, Cur);
+  }
+  return Peak;
+}
+
+bool BlockScheduler::schedule(BasicBlock &Block) {
+  BB = &Block;
+  Nodes.clear();
+  Index.clear();
+  PeakBefore = PeakAfter = 0;
+
+  // Debug intrinsics are left out and follow the instruction before them
+  std::vector<std::pair<Instruction *, Instruction *>> Dbg;
+  Instruction *Term = BB->getTerminator();
+  Instruction *Prev = nullptr;
+  for (auto i = BB->getFirstInsertionPt(); &*i != Term; ++i) {
+    if (isa<DbgInfoIntrinsic>(&*i)) {
+      Dbg.push_back(std::make_pair(&*i, Prev));
+      continue;
+    }
+    Index[&*i] = Nodes.size();
+    Nodes.push_back(Node());
+    Nodes.back().I = &*i;
+    Prev = &*i;
+  }
+  if (Nodes.size() < 3)
+    return false;
+
+  initLiveOut();
+  bool Precise = Nodes.size() <= PreciseLimit;
+  buildDAG(Precise);
+  computeNeeds();
+  std::vector<unsigned> Order;
+  if (Precise)
+    scheduleByPressure(Order);
+  else
+    scheduleByPriority(Order);
+  assert(Order.size() == Nodes.size() && "Dependence cycle in block DAG");
+
+  bool Same = true;
+  for (unsigned n = 0, e = Order.size(); n != e && Same; ++n)
+    Same = Order[n] == n;
+  if (Same)
+    return false;
+
+  std::vector<unsigned> Original(Nodes.size());
+  for (unsigned n = 0, e = Nodes.size(); n != e; ++n)
+    Original[n] = n;
+  PeakBefore = getPeak(Original);
+  PeakAfter = getPeak(Order);
+  if (PeakAfter >= PeakBefore)
+    return false;
+
+  for (auto n = Order.begin(), e = Order.end(); n != e; ++n)
+    Nodes[*n].I->moveBefore(Term);
+  // Debug intrinsics were left in place and now sit above the scheduled
+  // code. Those from the top of the block stay there; the others go back
+  // after their instruction, in reverse to keep their relative order.
+  for (auto d = Dbg.rbegin(), e = Dbg.rend(); d != e; ++d)
+    if (d->second)
+      d->first->moveAfter(d->second);
+  return true;
+}
@@ -0,0 +1,85 @@
+#ifndef MINREG_SCHEDULER_H
+#define MINREG_SCHEDULER_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+
+#include <vector>
+
+namespace llvm {
+  class AAResults;
+  class BasicBlock;
+  class DataLayout;
+  class Instruction;
+  class Value;
+}
+
+namespace minreg {
+  class LivenessQuery;
+
+  // Reorders the straight-line code of a block to lower its peak register
+  // pressure, counted in 32-bit register units.
+  //
+  // A dependence DAG is built over the instructions between the PHIs and
+  // the terminator. Instructions with side effects keep their order; reads
+  // of memory and instructions that are unsafe to speculate stay on the
+  // right side of the writes and calls they depend on. Blocks up to
+  // PreciseLimit instructions consult alias analysis for that and are
+  // scheduled bottom-up, always picking the ready instruction that frees
+  // the most registers, with Sethi-Ullman numbers breaking ties. Larger
+  // blocks fall back to conservative memory ordering and a static
+  // Sethi-Ullman priority, which keeps them at O(n log n).
+  //
+  // The new order is only applied when it lowers the block's peak. Debug
+  // intrinsics stay attached to the instruction they followed.
+  class BlockScheduler {
+  public:
+    BlockScheduler(llvm::AAResults &AA, const LivenessQuery &LQ,
+                   const llvm::DataLayout &DL, unsigned PreciseLimit)
+      : AA(AA), LQ(LQ), DL(DL), PreciseLimit(PreciseLimit) {}
+
+    // Returns true if BB was reordered
+    bool schedule(llvm::BasicBlock &BB);
+
+    // Peak register units of the last block scheduled, before and after
+    unsigned getPeakBefore() const { return PeakBefore; }
+    unsigned getPeakAfter() const { return PeakAfter; }
+
+  private:
+    struct Node {
+      llvm::Instruction *I;
+      llvm::SmallVector<unsigned, 4> Preds;
+      llvm::SmallVector<unsigned, 4> Succs;
+      llvm::SmallVector<unsigned, 4> Operands; // In-block SSA operands
+      unsigned Need = 0;                       // Sethi-Ullman number
+      unsigned SuccsLeft = 0;
+    };
+    typedef llvm::SmallPtrSet<llvm::Value *, 32> LiveSet;
+
+    void buildDAG(bool Precise);
+    void addEdge(unsigned From, unsigned To);
+    bool conflicts(llvm::Instruction *W, llvm::Instruction *R);
+    void computeNeeds();
+    void scheduleByPressure(std::vector<unsigned> &Order);
+    void scheduleByPriority(std::vector<unsigned> &Order);
+    unsigned getPeak(const std::vector<unsigned> &Order);
+
+    unsigned getUnits(llvm::Value *V) const;
+    int getDelta(unsigned N, const LiveSet &Live) const;
+    void initLiveOut();
+
+    llvm::AAResults &AA;
+    const LivenessQuery &LQ;
+    const llvm::DataLayout &DL;
+    unsigned PreciseLimit;
+
+    llvm::BasicBlock *BB = nullptr;
+    std::vector<Node> Nodes;
+    llvm::DenseMap<const llvm::Instruction *, unsigned> Index;
+    LiveSet LiveOut;
+    unsigned PeakBefore = 0, PeakAfter = 0;
+  };
+}
+
+#endif
@@ -1,49 +1,105 @@
-
 #include "llvm/Pass.h"
 
+#include "llvm/ADT/SmallString.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Module.h"
+#include "llvm/Support/Debug.h"
 #include "llvm/Support/raw_ostream.h"
 
-#include <string>
-#include <algorithm>
+#include "common/Instrumentation.h"
+#include "minreg/XLCleanup.h"
 
 using namespace llvm;
-using namespace std;
+
+#define DEBUG_TYPE "xlcleanup"
+
+STATISTIC(NumGlobalsRenamed, "Number of globals renamed");
+STATISTIC(NumValuesRenamed, "Number of arguments, blocks and instructions renamed");
+STATISTIC(NumGlobalsKept, "Number of globals not renamed because the name was taken");
+
+bool minreg::getCleanName(StringRef Name, SmallVectorImpl<char> &Clean) {
+  if (Name.find('$') == StringRef::npos)
+    return false;
+  Clean.clear();
+  for (auto c = Name.begin(), e = Name.end(); c != e; ++c)
+    if (*c != '$')
+      Clean.push_back(*c);
+  return true;
+}
+
+// A global's name is a symbol: if the clean name is already taken, the
+// global keeps its '$' rather than being uniqued into some other symbol.
+// Local globals are only renamed for readability, so uniquing is fine.
+static bool cleanupGlobal(GlobalValue &GV, SmallVectorImpl<char> &Clean) {
+  if (!minreg::getCleanName(GV.getName(), Clean))
+    return false;
+  StringRef Name(Clean.data(), Clean.size());
+  if (!GV.hasLocalLinkage() && (Name.empty() || GV.getParent()->getNamedValue(Name))) {
+    DEBUG(dbgs() << "Global kept: " << GV.getName() << ", " << Name << " is taken\n");
+    ++NumGlobalsKept;
+    return false;
+  }
+  DEBUG(dbgs() << "Global rename: " << GV.getName() << " -> " << Name << "\n");
+  GV.setName(Name);
+  ++NumGlobalsRenamed;
+  return true;
+}
+
+static bool cleanupLocal(Value &V, SmallVectorImpl<char> &Clean) {
+  if (!minreg::getCleanName(V.getName(), Clean))
+    return false;
+  V.setName(StringRef(Clean.data(), Clean.size()));
+  ++NumValuesRenamed;
+  return true;
+}
+
+static bool cleanupGlobalNames(Module &M) {
+  SmallString<128> Clean;
+  bool didSomething = false;
+  for (auto g = M.global_begin(), e = M.global_end(); g != e; ++g)
+    didSomething |= cleanupGlobal(*g, Clean);
+  for (auto F = M.begin(), e = M.end(); F != e; ++F)
+    didSomething |= cleanupGlobal(*F, Clean);
+  for (auto a = M.alias_begin(), e = M.alias_end(); a != e; ++a)
+    didSomething |= cleanupGlobal(*a, Clean);
+  for (auto i = M.ifunc_begin(), e = M.ifunc_end(); i != e; ++i)
+    didSomething |= cleanupGlobal(*i, Clean);
+  return didSomething;
+}
+
+static bool cleanupFunctionNames(Function &F) {
+  SmallString<128> Clean;
+  bool didSomething = false;
+  for (auto a = F.arg_begin(), e = F.arg_end(); a != e; ++a)
+    didSomething |= cleanupLocal(*a, Clean);
+  for (auto bb = F.begin(), e = F.end(); bb != e; ++bb) {
+    didSomething |= cleanupLocal(*bb, Clean);
+    for (auto i = bb->begin(), e = bb->end(); i != e; ++i)
+      didSomething |= cleanupLocal(*i, Clean);
+  }
+  return didSomething;
+}
+
+// Only names change, so every analysis stays valid.
+static bool cleanupNames(Module &M) {
+  instr::PhaseTimer T("rename", "xlcleanup");
+  bool didSomething = cleanupGlobalNames(M);
+  for (auto F = M.begin(), e = M.end(); F != e; ++F)
+    didSomething |= cleanupFunctionNames(*F);
+  return didSomething;
+}
 
 namespace {
   struct XLCleanup : public ModulePass {
     static char ID;
     XLCleanup() : ModulePass(ID) {}
 
+    void getAnalysisUsage(AnalysisUsage& AU) const override {
+      AU.setPreservesAll();
+    }
+
     bool runOnModule(Module &M) override {
-      bool didSomething = false;
-      // Handle any declarations
-      for (auto g = M.global_begin(), e = M.global_end(); g != e; ++g) {
-        if(g->getName()[0] == '$') {
-          string name = g->getName();
-          name.erase(remove(name.begin(), name.end(), '$'), name.end());
-          errs() << "Global rename: " << g->getName() << " -> " << name << "\n";
-          g->setName(name);
-          didSomething = true;
-        }
-      }
-
-      for (auto F = M.begin(), e = M.end(); F != e; ++F) {
-        // Handle any instructions
-        for (auto bb = F->begin(), e = F->end(); bb != e; ++bb) {
-          for (auto i = bb->begin(), e = bb->end(); i != e; ++i) {
-            if(i->getName().find('$') != string::npos) {
-              string name = i->getName();
-              name.erase(remove(name.begin(), name.end(), '$'), name.end());
-              i->setName(name);
-              didSomething = true;
-            }
-          }
-        }
-      }
-
-      return didSomething;
+      return cleanupNames(M);
     }
   };
 }
@@ -0,0 +1,15 @@
+#ifndef MINREG_XLCLEANUP_H
+#define MINREG_XLCLEANUP_H
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+
+namespace minreg {
+  // Writes Name without the '$' that the WCode translation leaves in names
+  // to Clean, and returns whether there was any. Most names have none, and
+  // cost a scan but no copy. Shared by xlcleanup and xlclean, so that both
+  // produce the same names.
+  bool getCleanName(llvm::StringRef Name, llvm::SmallVectorImpl<char> &Clean);
+}
+
+#endif
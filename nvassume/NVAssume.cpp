@@ -1,96 +1,360 @@
 #include "llvm/Pass.h"
 
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/DebugLoc.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/ConstantRange.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/IR/Module.h"
 
-#include <string>
-#include <unordered_map>
-
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/raw_ostream.h"
 
+#include "common/Instrumentation.h"
+
+#include <algorithm>
+#include <cstdint>
+
 using namespace llvm;
 
 #define DEBUG_TYPE "nvassume"
 
+static cl::opt<bool> EmitAssumes("nvassume-assumes",
+    cl::desc("Also state the ranges with llvm.assume calls"),
+    cl::init(false));
+
+// Where the reads of a special register end up
+enum ReadPlacement { KeepReads, HoistReads, RematReads };
+
+static cl::opt<ReadPlacement> Placement("nvassume-reads",
+    cl::desc("Placement of special register reads"),
+    cl::values(clEnumValN(KeepReads, "keep", "leave every read where it is"),
+               clEnumValN(HoistReads, "hoist", "one read per register, in the entry block"),
+               clEnumValN(RematReads, "remat", "one read per register and block, before its first use")),
+    cl::init(KeepReads));
+
+STATISTIC(NumRangedReads, "Number of special register reads given a range");
+STATISTIC(NumAssumes, "Number of llvm.assume calls injected");
+STATISTIC(NumReadsRemoved, "Number of special register reads replaced by another");
+STATISTIC(NumReadsRemat, "Number of special register reads placed near their uses");
+
 namespace {
 
-  struct Range {
-    Range() {}
-    Range(long min, long max) : min(min), max(max) {}
-    long min;
-    long max;
+  // Registers that launch bounds say something about
+  enum SRegKind { Tid, NTid, Other };
+
+  // Inclusive bounds of a special register, for any launch
+  struct SRegRange {
+    Intrinsic::ID ID;
+    int Min;
+    int Max;
+    SRegKind Kind;
+    unsigned Dim;
   };
 
+  const SRegRange SRegRanges[] = {
+    {Intrinsic::nvvm_read_ptx_sreg_tid_x, 0, 1023, Tid, 0},
+    {Intrinsic::nvvm_read_ptx_sreg_tid_y, 0, 1023, Tid, 1},
+    {Intrinsic::nvvm_read_ptx_sreg_tid_z, 0, 63, Tid, 2},
+    {Intrinsic::nvvm_read_ptx_sreg_ntid_x, 1, 1024, NTid, 0},
+    {Intrinsic::nvvm_read_ptx_sreg_ntid_y, 1, 1024, NTid, 1},
+    {Intrinsic::nvvm_read_ptx_sreg_ntid_z, 1, 64, NTid, 2},
+    {Intrinsic::nvvm_read_ptx_sreg_ctaid_x, 0, 2147483646, Other, 0},
+    {Intrinsic::nvvm_read_ptx_sreg_ctaid_y, 0, 65534, Other, 1},
+    {Intrinsic::nvvm_read_ptx_sreg_ctaid_z, 0, 65534, Other, 2},
+    {Intrinsic::nvvm_read_ptx_sreg_nctaid_x, 1, 2147483647, Other, 0},
+    {Intrinsic::nvvm_read_ptx_sreg_nctaid_y, 1, 65535, Other, 1},
+    {Intrinsic::nvvm_read_ptx_sreg_nctaid_z, 1, 65535, Other, 2},
+    {Intrinsic::nvvm_read_ptx_sreg_warpsize, 16, 64, Other, 0}
+  };
 
-  struct NVAssume : public FunctionPass {
-    static char ID;
-    NVAssume() : FunctionPass(ID) {}
+  const SRegRange *getSRegRange(Intrinsic::ID ID) {
+    for (const SRegRange &R : SRegRanges)
+      if (R.ID == ID)
+        return &R;
+    return nullptr;
+  }
 
-    std::unordered_map<std::string, Range> intrinsics = {
-      {"llvm.nvvm.read.ptx.sreg.tid.x", Range(0, 1023)},
-      {"llvm.nvvm.read.ptx.sreg.tid.y", Range(0, 1023)},
-      {"llvm.nvvm.read.ptx.sreg.tid.z", Range(0, 63)},
-      {"llvm.nvvm.read.ptx.sreg.ntid.x", Range(1, 1023)},
-      {"llvm.nvvm.read.ptx.sreg.ntid.y", Range(1, 1023)},
-      {"llvm.nvvm.read.ptx.sreg.ntid.z", Range(1, 63)},
-      {"llvm.nvvm.read.ptx.sreg.ctaid.x", Range(0, 2147483645)},
-      {"llvm.nvvm.read.ptx.sreg.ctaid.y", Range(0, 65534)},
-      {"llvm.nvvm.read.ptx.sreg.ctaid.z", Range(0, 65534)},
-      {"llvm.nvvm.read.ptx.sreg.nctaid.x", Range(1, 2147483646)},
-      {"llvm.nvvm.read.ptx.sreg.nctaid.y", Range(1, 65535)},
-      {"llvm.nvvm.read.ptx.sreg.nctaid.z", Range(1, 65535)},
-      {"llvm.nvvm.read.ptx.sreg.warpsize", Range(16, 64)}
-    };
+  // Block sizes a kernel declares in nvvm.annotations; 0 where it does not
+  struct LaunchBounds {
+    unsigned ReqNTid[3];
+    unsigned MaxNTid[3];
 
-    void getAnalysisUsage(AnalysisUsage& AU) const override {
+    LaunchBounds() : ReqNTid(), MaxNTid() {}
+
+    // Threads in a block, at most; 0 if unbounded. .maxntid bounds the
+    // product of the extents, not each one, and missing extents are 1.
+    uint64_t getMaxThreads() const {
+      const unsigned *N = ReqNTid[0] || ReqNTid[1] || ReqNTid[2] ? ReqNTid : MaxNTid;
+      if (!N[0] && !N[1] && !N[2])
+        return 0;
+      uint64_t Threads = 1;
+      for (unsigned d = 0; d < 3; ++d)
+        Threads = std::min<uint64_t>(Threads * (N[d] ? N[d] : 1), UINT32_MAX);
+      return Threads;
     }
 
+    // The exact extent in dimension d; 0 if not required
+    unsigned getReqNTid(unsigned d) const {
+      if (!ReqNTid[0] && !ReqNTid[1] && !ReqNTid[2])
+        return 0;
+      return ReqNTid[d] ? ReqNTid[d] : 1;
+    }
+  };
 
-    bool runOnFunction(Function &F) override {
-      LLVMContext& Ctx = F.getContext();
+  typedef DenseMap<const Function *, LaunchBounds> LaunchBoundsMap;
 
-      bool injected = false;
-      Function *assume = Intrinsic::getDeclaration(F.getParent(), Intrinsic::assume);
-      DEBUG(dbgs() << "Assume name: " << assume->getName() << "\n");
+  // Reads the reqntid and maxntid annotations of every function in M, in
+  // one sweep over nvvm.annotations. maxnreg and the others do not bound
+  // any register read here.
+  void readLaunchBounds(const Module &M, LaunchBoundsMap &Bounds) {
+    NamedMDNode *Annotations = M.getNamedMetadata("nvvm.annotations");
+    if (!Annotations)
+      return;
+    for (const MDNode *MD : Annotations->operands()) {
+      const Function *F = MD->getNumOperands() == 0 ? nullptr
+                        : mdconst::dyn_extract_or_null<Function>(MD->getOperand(0));
+      if (!F)
+        continue;
+      LaunchBounds &B = Bounds[F];
+      // Key and value pairs follow the function
+      for (unsigned i = 1; i + 1 < MD->getNumOperands(); i += 2) {
+        MDString *Key = dyn_cast<MDString>(MD->getOperand(i));
+        ConstantInt *Val = mdconst::dyn_extract_or_null<ConstantInt>(MD->getOperand(i + 1));
+        if (!Key || !Val || Val->isZero() || Val->getValue().getActiveBits() > 31)
+          continue;
+        StringRef Name = Key->getString();
+        unsigned *Field = Name.startswith("reqntid") ? B.ReqNTid
+                        : Name.startswith("maxntid") ? B.MaxNTid : nullptr;
+        if (!Field || Name.size() != 8 || Name[7] < 'x' || Name[7] > 'z')
+          continue;
+        Field[Name[7] - 'x'] = Val->getZExtValue();
+      }
+    }
+  }
 
-      for (auto bb = F.begin(), e = F.end(); bb != e; ++bb) {
-        for (auto i = bb->begin(), e = bb->end(); i != e; ++i) {
+  // R tightened by what the launch bounds of its kernel imply
+  SRegRange tighten(SRegRange R, const LaunchBounds &B) {
+    if (R.Kind == Other)
+      return R;
+    unsigned Req = B.getReqNTid(R.Dim);
+    uint64_t Extent = Req ? Req : B.getMaxThreads();
+    if (!Extent)
+      return R;
+    SRegRange T = R;
+    // Thread ids run from 0 up to the extent, exclusive
+    T.Max = std::min<int64_t>(R.Max, R.Kind == Tid ? Extent - 1 : Extent);
+    if (Req && R.Kind == NTid)
+      T.Min = std::max<int64_t>(R.Min, Req);
+    // Annotations no launch can satisfy say nothing
+    return T.Min <= T.Max ? T : R;
+  }
+
+  // The pass itself, run by the legacy pass wrapper below.
+  // Reads of special registers get their range as !range metadata, which
+  // costs later passes nothing, and optionally as assumes as well.
+  struct NVAssumeImpl {
+    // Attaches R to the read c, keeping a tighter range already there.
+    // Returns false if c already had R or better.
+    static bool addRange(CallInst *c, ConstantRange R) {
+      if (MDNode *Old = c->getMetadata(LLVMContext::MD_range)) {
+        ConstantRange Have = getConstantRangeFromMetadata(*Old);
+        if (R.contains(Have))
+          return false;
+        R = R.intersectWith(Have);
+        if (R.isEmptySet())
+          return false;
+      }
+      MDBuilder MDB(c->getContext());
+      c->setMetadata(LLVMContext::MD_range, MDB.createRange(R.getLower(), R.getUpper()));
+      return true;
+    }
+
+    // Inserts llvm.assume(min <= c) and llvm.assume(c <= max) after c
+    static void addAssumes(CallInst *c, const SRegRange &range) {
+      Function *assume = Intrinsic::getDeclaration(c->getModule(), Intrinsic::assume);
+      Type *Ty = c->getType();
+      ICmpInst *minCmp = new ICmpInst(ICmpInst::Predicate::ICMP_SGE, c,
+                                      ConstantInt::get(Ty, range.Min, true), "assume_tmp");
+      ICmpInst *maxCmp = new ICmpInst(ICmpInst::Predicate::ICMP_SLE, c,
+                                      ConstantInt::get(Ty, range.Max, true), "assume_tmp");
+      CallInst *minCall = CallInst::Create(assume, ArrayRef<Value *>(minCmp));
+      CallInst *maxCall = CallInst::Create(assume, ArrayRef<Value *>(maxCmp));
+      minCmp->insertAfter(c);
+      maxCmp->insertAfter(minCmp);
+      minCall->insertAfter(maxCmp);
+      maxCall->insertAfter(minCall);
+      NumAssumes += 2;
+    }
+
+    // Replaces Reads, all of one register, by a single read at the top of
+    // the entry block. A range on one read may only hold where that read
+    // was, so the merged read starts without one, and without a location.
+    static void hoistReads(Function &F, ArrayRef<IntrinsicInst *> Reads) {
+      IntrinsicInst *Keep = Reads.front();
+      Keep->moveBefore(&*F.getEntryBlock().getFirstInsertionPt());
+      Keep->setMetadata(LLVMContext::MD_range, nullptr);
+      Keep->setDebugLoc(DebugLoc());
+      for (auto r = Reads.begin() + 1, e = Reads.end(); r != e; ++r) {
+        (*r)->replaceAllUsesWith(Keep);
+        (*r)->eraseFromParent();
+        ++NumReadsRemoved;
+      }
+    }
 
-          if(CallInst *c = dyn_cast<CallInst>(i)) {
-            if(intrinsics.count(c->getCalledFunction()->getName()) > 0) {
-              DEBUG(dbgs() << "Injecting range for " << c->getCalledFunction()->getName() << "\n");
-              injected = true;
-              Range range = intrinsics[c->getCalledFunction()->getName()];
+    // Replaces Reads, all of one register, by one read per block that uses
+    // the register, right before the first use there, so that no read is
+    // live across blocks. Phis use the value at the end of the incoming
+    // block. Each new read takes the location of the use it precedes, and
+    // no range.
+    static void rematReads(ArrayRef<IntrinsicInst *> Reads) {
+      SmallVector<Use *, 16> Uses;
+      SmallPtrSet<Instruction *, 16> Points;
+      SmallVector<BasicBlock *, 8> Blocks;
+      SmallPtrSet<BasicBlock *, 8> Seen;
+      for (auto r = Reads.begin(), e = Reads.end(); r != e; ++r)
+        for (auto u = (*r)->use_begin(), ue = (*r)->use_end(); u != ue; ++u) {
+          Instruction *Point = getUsePoint(*u);
+          Uses.push_back(&*u);
+          Points.insert(Point);
+          if (Seen.insert(Point->getParent()).second)
+            Blocks.push_back(Point->getParent());
+        }
 
-              ConstantInt *min = ConstantInt::get(Type::getInt32Ty(Ctx), range.min, true);
-              ConstantInt *max = ConstantInt::get(Type::getInt32Ty(Ctx), range.max, true);
+      DenseMap<BasicBlock *, IntrinsicInst *> Local;
+      for (auto b = Blocks.begin(), e = Blocks.end(); b != e; ++b)
+        for (auto i = (*b)->begin(), ie = (*b)->end(); i != ie; ++i)
+          if (Points.count(&*i)) {
+            IntrinsicInst *Read = cast<IntrinsicInst>(Reads.front()->clone());
+            Read->insertBefore(&*i);
+            Read->setName(Reads.front()->getName());
+            Read->setMetadata(LLVMContext::MD_range, nullptr);
+            Read->setDebugLoc(i->getDebugLoc());
+            Local[*b] = Read;
+            ++NumReadsRemat;
+            break;
+          }
+      for (auto u = Uses.begin(), e = Uses.end(); u != e; ++u)
+        (*u)->set(Local[getUsePoint(**u)->getParent()]);
 
+      for (auto r = Reads.begin(), e = Reads.end(); r != e; ++r) {
+        (*r)->eraseFromParent();
+        ++NumReadsRemoved;
+      }
+    }
 
-              ICmpInst *minCmp = new ICmpInst(ICmpInst::Predicate::ICMP_SGE, c, min, "assume_tmp");
-              i = bb->getInstList().insert(++i, minCmp);
-              ICmpInst *maxCmp = new ICmpInst(ICmpInst::Predicate::ICMP_SLE, c, max, "assume_tmp");
-              i = bb->getInstList().insert(++i, maxCmp);
+    // Where a use needs its value: at the user, or for a phi at the end of
+    // the incoming block
+    static Instruction *getUsePoint(const Use &U) {
+      Instruction *User = cast<Instruction>(U.getUser());
+      if (PHINode *P = dyn_cast<PHINode>(User))
+        return P->getIncomingBlock(U)->getTerminator();
+      return User;
+    }
 
-              ArrayRef<Value *> minArgs(minCmp);
-              CallInst *minCall = CallInst::Create(assume, minArgs, "");
-              i = bb->getInstList().insert(++i, minCall);
+    // Hoists or rematerializes the reads of each register in the table.
+    // The registers are fixed for the whole launch, so any read will do.
+    static bool placeReads(Function &F) {
+      SmallVector<SmallVector<IntrinsicInst *, 8>, 16> ByReg(array_lengthof(SRegRanges));
+      for (auto bb = F.begin(), e = F.end(); bb != e; ++bb)
+        for (auto i = bb->begin(), e = bb->end(); i != e; ++i)
+          if (IntrinsicInst *c = dyn_cast<IntrinsicInst>(i))
+            if (const SRegRange *range = getSRegRange(c->getIntrinsicID()))
+              ByReg[range - SRegRanges].push_back(c);
 
-              ArrayRef<Value *> maxArgs(maxCmp);
-              CallInst *maxCall = CallInst::Create(assume, maxArgs, "");
-              i = bb->getInstList().insert(++i, maxCall);
-            }
+      bool changed = false;
+      for (auto r = ByReg.begin(), e = ByReg.end(); r != e; ++r) {
+        if (r->empty())
+          continue;
+        if (Placement == HoistReads)
+          hoistReads(F, *r);
+        else
+          rematReads(*r);
+        changed = true;
+      }
+      return changed;
+    }
+
+    bool run(Function &F, const LaunchBounds &Bounds, OptimizationRemarkEmitter &ORE) {
+      instr::PhaseTimer T("inject", "nvassume");
+
+      bool injected = Placement != KeepReads && placeReads(F);
+      for (auto bb = F.begin(), e = F.end(); bb != e; ++bb) {
+        for (auto i = bb->begin(), e = bb->end(); i != e; ++i) {
+          // Indirect calls are not intrinsics, and have no callee to ask
+          IntrinsicInst *c = dyn_cast<IntrinsicInst>(i);
+          if (!c || !c->getType()->isIntegerTy(32))
+            continue;
+          const SRegRange *entry = getSRegRange(c->getIntrinsicID());
+          if (!entry)
+            continue;
+          SRegRange range = tighten(*entry, Bounds);
+
+          DEBUG(dbgs() << "Injecting range for " << c->getCalledFunction()->getName() << "\n");
+          ConstantRange R(APInt(32, range.Min, true), APInt(32, range.Max, true) + 1);
+          bool added = addRange(c, R);
+          if (EmitAssumes) {
+            addAssumes(c, range);
+            added = true;
           }
+          if (!added)
+            continue;
+          injected = true;
+          ++NumRangedReads;
+          ORE.emit(OptimizationRemark(DEBUG_TYPE, "InjectedRange", c)
+                   << "assumed " << ore::NV("Min", range.Min)
+                   << " <= " << ore::NV("Intrinsic", c->getCalledFunction()->getName())
+                   << " <= " << ore::NV("Max", range.Max));
         }
       }
       return injected;
     }
   };
+
+  struct NVAssume : public FunctionPass {
+    static char ID;
+    NVAssume() : FunctionPass(ID) {}
+
+    // Launch bounds of the module's functions, read once per module
+    LaunchBoundsMap Bounds;
+
+    bool doInitialization(Module &M) override {
+      readLaunchBounds(M, Bounds);
+      return false;
+    }
+
+    bool doFinalization(Module &M) override {
+      Bounds.clear();
+      return false;
+    }
+
+    void getAnalysisUsage(AnalysisUsage& AU) const override {
+      AU.addRequired<OptimizationRemarkEmitterWrapperPass>();
+      // Only straight-line code is added
+      AU.setPreservesCFG();
+    }
+
+    bool runOnFunction(Function &F) override {
+      NVAssumeImpl Impl;
+      auto it = Bounds.find(&F);
+      return Impl.run(F, it == Bounds.end() ? LaunchBounds() : it->second,
+                      getAnalysis<OptimizationRemarkEmitterWrapperPass>().getORE());
+    }
+  };
 }
 
 char NVAssume::ID = 0;
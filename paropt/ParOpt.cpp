@@ -0,0 +1,354 @@
+// paropt: runs function passes over the definitions of a module in parallel.
+//
+//   paropt -load MinRegGCM.so -minreg -j 64 in.bc -o out.bc
+//
+// The definitions are cut into contiguous work units of roughly equal size.
+// Each unit is cloned into its own module, keeping only its definitions
+// and declaring everything else, and handed to a worker as bitcode. The
+// worker parses it into a private LLVMContext, runs the passes and writes
+// it back. Units are then linked over the original definitions in module
+// order, so the output does not depend on the number of threads or on
+// which worker finished first.
+//
+// Declarations cannot be local, so local symbols are made external while
+// the units are out and get their linkage back once everything is linked.
+// Likewise definitions leave their comdats behind: the linker keeps the
+// comdat it already has, and with it the unoptimized bodies.
+// Only function passes are accepted: a module pass would see one unit at
+// a time, not the module. Timers are process-wide, so -time-passes only
+// works with one worker.
+//
+// Each worker builds its own TargetMachine from the module triple and the
+// codegen flags, as opt does, so that the passes see the same target
+// library info and cost model they would see under opt.
+
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/CodeGen/CommandFlags.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/LegacyPassNameParser.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/InitializePasses.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/PluginLoader.h"
+#include "llvm/Support/PrettyStackTrace.h"
+#include "llvm/Support/Signals.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TargetRegistry.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace llvm;
+
+static cl::list<const PassInfo *, bool, PassNameParser>
+PassList(cl::desc("Function passes to run, in order:"));
+
+static cl::opt<std::string> InputFilename(cl::Positional,
+    cl::desc("<input bitcode file>"), cl::init("-"), cl::value_desc("filename"));
+
+static cl::opt<std::string> OutputFilename("o", cl::desc("Output filename"),
+    cl::init("-"), cl::value_desc("filename"));
+
+static cl::opt<bool> OutputAssembly("S", cl::desc("Write output as LLVM assembly"));
+
+static cl::opt<unsigned> Threads("j",
+    cl::desc("Number of worker threads (default: one per hardware thread)"),
+    cl::init(0));
+
+static cl::opt<unsigned> UnitsPerThread("units-per-thread",
+    cl::desc("Work units per worker thread, to even out uneven functions"),
+    cl::init(4));
+
+namespace {
+  // The definitions one worker optimizes, in module order
+  struct WorkUnit {
+    std::vector<const Function *> Funcs;
+    std::string Bitcode;
+  };
+
+  // Local symbols made external while the units are out
+  struct SavedLinkage {
+    std::string Name;
+    GlobalValue::LinkageTypes Linkage;
+    bool Unnamed;
+  };
+
+  // The codegen flags, read once on the main thread
+  struct TargetFlags {
+    std::string CPU, Features;
+    TargetOptions Options;
+  };
+
+  // Comdats taken off the definitions while the units are out
+  struct SavedComdat {
+    std::string Name;
+    Comdat *C;
+  };
+}
+
+static unsigned getSize(const Function &F) {
+  unsigned Size = 0;
+  for (auto bb = F.begin(), e = F.end(); bb != e; ++bb)
+    Size += bb->size();
+  return Size;
+}
+
+// Cuts the definitions of M into at most MaxUnits contiguous runs of about
+// the same number of instructions.
+static void partition(const Module &M, unsigned MaxUnits, std::vector<WorkUnit> &Units) {
+  std::vector<std::pair<const Function *, unsigned>> Defs;
+  unsigned long Total = 0;
+  for (auto F = M.begin(), e = M.end(); F != e; ++F) {
+    if (F->isDeclaration())
+      continue;
+    Defs.push_back(std::make_pair(&*F, getSize(*F)));
+    Total += Defs.back().second;
+  }
+  if (Defs.empty())
+    return;
+
+  unsigned NumUnits = std::min<unsigned>(MaxUnits, Defs.size());
+  unsigned long Target = (Total + NumUnits - 1) / NumUnits, Filled = 0;
+  Units.push_back(WorkUnit());
+  for (auto d = Defs.begin(), e = Defs.end(); d != e; ++d) {
+    if (Filled >= Target && Units.size() < NumUnits) {
+      Units.push_back(WorkUnit());
+      Filled = 0;
+    }
+    Units.back().Funcs.push_back(d->first);
+    Filled += d->second;
+  }
+}
+
+static void externalizeLocals(Module &M, std::vector<SavedLinkage> &Saved) {
+  auto save = [&](GlobalValue &GV) {
+    if (!GV.hasLocalLinkage())
+      return;
+    SavedLinkage S = {"", GV.getLinkage(), !GV.hasName()};
+    if (S.Unnamed)
+      GV.setName("__paropt_unnamed");
+    S.Name = GV.getName();
+    GV.setLinkage(GlobalValue::ExternalLinkage);
+    Saved.push_back(S);
+  };
+  for (auto &F : M)
+    save(F);
+  for (auto &GV : M.globals())
+    save(GV);
+  for (auto &GA : M.aliases())
+    save(GA);
+}
+
+static void restoreLocals(Module &M, const std::vector<SavedLinkage> &Saved) {
+  for (auto s = Saved.begin(), e = Saved.end(); s != e; ++s) {
+    GlobalValue *GV = M.getNamedValue(s->Name);
+    assert(GV && "Externalized symbol lost while linking");
+    GV->setLinkage(s->Linkage);
+    if (s->Unnamed)
+      GV->setName("");
+  }
+}
+
+static void detachComdats(Module &M, std::vector<SavedComdat> &Saved) {
+  for (auto &F : M) {
+    if (F.isDeclaration() || !F.hasComdat())
+      continue;
+    SavedComdat S = {F.getName(), F.getComdat()};
+    F.setComdat(nullptr);
+    Saved.push_back(S);
+  }
+}
+
+static void restoreComdats(Module &M, const std::vector<SavedComdat> &Saved) {
+  for (auto s = Saved.begin(), e = Saved.end(); s != e; ++s) {
+    Function *F = M.getFunction(s->Name);
+    assert(F && "Definition in a comdat lost while linking");
+    F->setComdat(s->C);
+  }
+}
+
+// As in opt, a module without a known target gets no TargetMachine, and
+// the passes get the default cost model.
+static std::unique_ptr<TargetMachine> createTargetMachine(const Module &M,
+                                                          const TargetFlags &Flags) {
+  Triple TheTriple(M.getTargetTriple());
+  if (TheTriple.getArch() == Triple::UnknownArch)
+    return nullptr;
+  std::string Error;
+  const Target *TheTarget = TargetRegistry::lookupTarget(MArch, TheTriple, Error);
+  if (!TheTarget)
+    return nullptr;
+  return std::unique_ptr<TargetMachine>(TheTarget->createTargetMachine(
+      TheTriple.getTriple(), Flags.CPU, Flags.Features, Flags.Options, getRelocModel(),
+      CMModel, CodeGenOpt::Default));
+}
+
+// Runs on a worker thread, with nothing shared but the pass and target
+// registries
+static void optimizeUnit(std::string &Bitcode, const TargetFlags &Flags) {
+  LLVMContext Context;
+  Expected<std::unique_ptr<Module>> M =
+      parseBitcodeFile(MemoryBufferRef(Bitcode, "<unit>"), Context);
+  if (!M)
+    report_fatal_error(Twine("paropt: cannot read work unit: ") + toString(M.takeError()));
+
+  std::unique_ptr<TargetMachine> TM = createTargetMachine(**M, Flags);
+  legacy::PassManager PM;
+  PM.add(new TargetLibraryInfoWrapperPass(Triple((*M)->getTargetTriple())));
+  PM.add(createTargetTransformInfoWrapperPass(TM ? TM->getTargetIRAnalysis()
+                                                 : TargetIRAnalysis()));
+  for (auto p = PassList.begin(), e = PassList.end(); p != e; ++p)
+    PM.add((*p)->createPass());
+  PM.add(createVerifierPass());
+  PM.run(**M);
+
+  // The original keeps the module-level metadata; linking it back from
+  // every unit would repeat it once per unit.
+  std::vector<NamedMDNode *> Named;
+  for (auto &MD : (*M)->named_metadata())
+    Named.push_back(&MD);
+  for (auto n = Named.begin(), e = Named.end(); n != e; ++n)
+    (*M)->eraseNamedMetadata(*n);
+
+  Bitcode.clear();
+  raw_string_ostream OS(Bitcode);
+  WriteBitcodeToFile(M->get(), OS);
+  OS.flush();
+}
+
+int main(int argc, char **argv) {
+  sys::PrintStackTraceOnErrorSignal(argv[0]);
+  PrettyStackTraceProgram X(argc, argv);
+  llvm_shutdown_obj Y;
+
+  PassRegistry &Registry = *PassRegistry::getPassRegistry();
+  initializeCore(Registry);
+  initializeAnalysis(Registry);
+  initializeTransformUtils(Registry);
+  InitializeAllTargets();
+  InitializeAllTargetMCs();
+  InitializeAllAsmPrinters();
+  InitializeAllAsmParsers();
+
+  cl::ParseCommandLineOptions(argc, argv, "parallel function pass driver\n");
+
+  for (auto p = PassList.begin(), e = PassList.end(); p != e; ++p) {
+    std::unique_ptr<Pass> P((*p)->createPass());
+    if (P->getPassKind() != PT_Function) {
+      errs() << argv[0] << ": " << (*p)->getPassArgument()
+             << " is not a function pass; run it with opt\n";
+      return 1;
+    }
+  }
+
+  unsigned NumThreads = Threads;
+  if (!NumThreads)
+    NumThreads = std::max(1u, std::thread::hardware_concurrency());
+  // The pass timers and the phase timers of the passes are process-wide,
+  // and would be started and stopped by several workers at once
+  if (TimePassesIsEnabled && NumThreads > 1) {
+    errs() << argv[0] << ": -time-passes needs -j 1\n";
+    return 1;
+  }
+
+  LLVMContext Context;
+  SMDiagnostic Err;
+  std::unique_ptr<Module> M = parseIRFile(InputFilename, Err, Context);
+  if (!M) {
+    Err.print(argv[0], errs());
+    return 1;
+  }
+
+  std::error_code EC;
+  std::unique_ptr<tool_output_file> Out(new tool_output_file(
+      OutputFilename, EC, OutputAssembly ? sys::fs::F_Text : sys::fs::F_None));
+  if (EC) {
+    errs() << argv[0] << ": " << EC.message() << "\n";
+    return 1;
+  }
+
+  std::vector<WorkUnit> Units;
+  partition(*M, NumThreads * std::max(1u, (unsigned)UnitsPerThread), Units);
+
+  std::vector<SavedLinkage> Saved;
+  externalizeLocals(*M, Saved);
+  std::vector<SavedComdat> Comdats;
+  detachComdats(*M, Comdats);
+
+  // Contexts are not thread safe, so the units are cut out up front
+  for (auto u = Units.begin(), e = Units.end(); u != e; ++u) {
+    SmallPtrSet<const GlobalValue *, 16> Defs(u->Funcs.begin(), u->Funcs.end());
+    ValueToValueMapTy VMap;
+    std::unique_ptr<Module> Unit = CloneModule(M.get(), VMap,
+        [&](const GlobalValue *GV) { return Defs.count(GV) != 0; });
+    raw_string_ostream OS(u->Bitcode);
+    WriteBitcodeToFile(Unit.get(), OS);
+    OS.flush();
+  }
+
+  TargetFlags Flags;
+  Flags.CPU = getCPUStr();
+  Flags.Features = getFeaturesStr();
+  Flags.Options = InitTargetOptionsFromCodeGenFlags();
+
+  ThreadPool Pool(NumThreads);
+  for (auto u = Units.begin(), e = Units.end(); u != e; ++u) {
+    std::string *Bitcode = &u->Bitcode;
+    Pool.async([Bitcode, &Flags] { optimizeUnit(*Bitcode, Flags); });
+  }
+  Pool.wait();
+
+  // Link in module order; each unit's definitions replace the originals
+  Linker L(*M);
+  for (auto u = Units.begin(), e = Units.end(); u != e; ++u) {
+    Expected<std::unique_ptr<Module>> Unit =
+        parseBitcodeFile(MemoryBufferRef(u->Bitcode, "<unit>"), Context);
+    if (!Unit) {
+      errs() << argv[0] << ": " << toString(Unit.takeError()) << "\n";
+      return 1;
+    }
+    if (L.linkInModule(std::move(*Unit), Linker::OverrideFromSrc)) {
+      errs() << argv[0] << ": failed to link a work unit back\n";
+      return 1;
+    }
+    std::string().swap(u->Bitcode);
+  }
+  // By name, so before the unnamed locals lose theirs
+  restoreComdats(*M, Comdats);
+  restoreLocals(*M, Saved);
+
+  if (verifyModule(*M, &errs())) {
+    errs() << argv[0] << ": linked module is broken\n";
+    return 1;
+  }
+
+  if (OutputAssembly)
+    M->print(Out->os(), nullptr);
+  else
+    WriteBitcodeToFile(M.get(), Out->os());
+  Out->keep();
+  return 0;
+}
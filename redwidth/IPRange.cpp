@@ -0,0 +1,243 @@
+// Interprocedural ranges: once a thread id is passed to a helper that is
+// not inlined, the helper's own RangeAnalysis sees an argument that may
+// hold anything. This module pass hands the ranges across calls.
+//
+// Callers are visited before their callees. The ranges a local function
+// is called with, joined over all of its calls, become llvm.assume calls
+// at the top of its entry block, which RangeAnalysis reads as the range
+// of the argument. Then callees are visited before their callers, and the
+// range a function returns becomes !range metadata on the calls to it.
+// Ranges coming from NVAssume's !range on special register reads flow
+// through both.
+//
+// Arguments only take ranges from callers when every caller is known: the
+// function is local, only ever called directly, and not recursive.
+
+#include "llvm/Pass.h"
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SCCIterator.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Analysis/AssumptionCache.h"
+#include "llvm/Analysis/CallGraph.h"
+#include "llvm/Analysis/ValueTracking.h"
+
+#include "llvm/IR/ConstantRange.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Module.h"
+
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "common/Instrumentation.h"
+#include "redwidth/RangeAnalysis.h"
+
+#include <vector>
+
+using namespace llvm;
+
+#define DEBUG_TYPE "iprange"
+
+STATISTIC(NumArgsRanged, "Number of arguments given a range by their callers");
+STATISTIC(NumCallsRanged, "Number of calls given the range their callee returns");
+
+namespace {
+  // The call U makes to F, if U is one
+  CallInst *getCallTo(const Use &U, const Function &F) {
+    CallInst *CI = dyn_cast<CallInst>(U.getUser());
+    // The callee is the last operand
+    if (!CI || U.getOperandNo() != CI->getNumOperands() - 1 ||
+        CI->getFunctionType() != F.getFunctionType())
+      return nullptr;
+    return CI;
+  }
+
+  // Are all the calls to F in view, and nothing else done with it?
+  bool hasKnownCallers(const Function &F) {
+    if (!F.hasLocalLinkage() || F.isDeclaration())
+      return false;
+    for (const Use &U : F.uses())
+      if (!getCallTo(U, F))
+        return false;
+    return true;
+  }
+
+  struct IPRangeImpl {
+    redwidth::RangeAnalysis RA;
+    // Told about the new assumes, when the pass manager has one
+    AssumptionCacheTracker *ACT = nullptr;
+    // Functions whose arguments take the ranges of their callers
+    SmallPtrSet<const Function *, 16> Known;
+    // The ranges passed to their arguments, joined over the calls so far
+    DenseMap<const Argument *, ConstantRange> ArgRanges;
+
+    // Joins the ranges F passes to functions with known callers
+    void collectArgRanges(Function &F) {
+      for (auto bb = F.begin(), e = F.end(); bb != e; ++bb)
+        for (auto i = bb->begin(), e = bb->end(); i != e; ++i) {
+          CallInst *CI = dyn_cast<CallInst>(&*i);
+          Function *Callee = CI ? CI->getCalledFunction() : nullptr;
+          if (!Callee || !Known.count(Callee))
+            continue;
+          for (unsigned a = 0, n = Callee->arg_size(); a != n; ++a) {
+            Value *V = CI->getArgOperand(a);
+            if (!V->getType()->isIntegerTy())
+              continue;
+            const Argument *A = Callee->arg_begin() + a;
+            ConstantRange R = RA.getRange(V);
+            auto it = ArgRanges.find(A);
+            if (it != ArgRanges.end())
+              it->second = it->second.unionWith(R);
+            else
+              ArgRanges.insert(std::make_pair(A, R));
+          }
+        }
+    }
+
+    // States the ranges F's callers pass with assumes at the top of F, in
+    // signed bounds where those say anything, else in unsigned ones
+    bool assumeArgRanges(Function &F) {
+      bool Changed = false;
+      Function *Assume = Intrinsic::getDeclaration(F.getParent(), Intrinsic::assume);
+      Instruction *Top = &*F.getEntryBlock().getFirstInsertionPt();
+      for (auto a = F.arg_begin(), e = F.arg_end(); a != e; ++a) {
+        auto it = ArgRanges.find(&*a);
+        // An empty range says no call is ever reached, and assuming it
+        // would make the entry undefined
+        if (it == ArgRanges.end() || it->second.isFullSet() || it->second.isEmptySet() ||
+            a->use_empty())
+          continue;
+        const ConstantRange &R = it->second;
+        SmallVector<std::pair<CmpInst::Predicate, APInt>, 2> Bounds;
+        if (!R.getSignedMin().isMinSignedValue())
+          Bounds.push_back(std::make_pair(CmpInst::ICMP_SGE, R.getSignedMin()));
+        if (!R.getSignedMax().isMaxSignedValue())
+          Bounds.push_back(std::make_pair(CmpInst::ICMP_SLE, R.getSignedMax()));
+        if (Bounds.empty()) {
+          if (!R.getUnsignedMin().isMinValue())
+            Bounds.push_back(std::make_pair(CmpInst::ICMP_UGE, R.getUnsignedMin()));
+          if (!R.getUnsignedMax().isMaxValue())
+            Bounds.push_back(std::make_pair(CmpInst::ICMP_ULE, R.getUnsignedMax()));
+        }
+        if (Bounds.empty())
+          continue;
+
+        DEBUG(dbgs() << "Argument " << a->getName() << " of " << F.getName()
+                     << " in " << R << "\n");
+        for (auto b = Bounds.begin(), be = Bounds.end(); b != be; ++b) {
+          ICmpInst *Cmp = new ICmpInst(Top, b->first, &*a,
+                                       ConstantInt::get(a->getContext(), b->second),
+                                       "assume_tmp");
+          CallInst *CI = CallInst::Create(Assume, ArrayRef<Value *>(Cmp), "", Top);
+          if (ACT)
+            ACT->getAssumptionCache(F).registerAssumption(CI);
+        }
+        ++NumArgsRanged;
+        Changed = true;
+      }
+      return Changed;
+    }
+
+    // Puts the range F returns on the calls to it, keeping a tighter
+    // range already there
+    bool rangeCalls(Function &F) {
+      ConstantRange R(F.getReturnType()->getIntegerBitWidth(), false);
+      for (auto bb = F.begin(), e = F.end(); bb != e; ++bb)
+        if (ReturnInst *RI = dyn_cast<ReturnInst>(bb->getTerminator()))
+          R = R.unionWith(RA.getRange(RI->getReturnValue()));
+      if (R.isEmptySet() || R.isFullSet())
+        return false;
+
+      bool Changed = false;
+      MDBuilder MDB(F.getContext());
+      for (const Use &U : F.uses()) {
+        CallInst *CI = getCallTo(U, F);
+        if (!CI)
+          continue;
+        ConstantRange CR = R;
+        if (MDNode *Old = CI->getMetadata(LLVMContext::MD_range)) {
+          ConstantRange Have = getConstantRangeFromMetadata(*Old);
+          if (CR.contains(Have))
+            continue;
+          CR = CR.intersectWith(Have);
+          if (CR.isEmptySet())
+            continue;
+        }
+        CI->setMetadata(LLVMContext::MD_range, MDB.createRange(CR.getLower(), CR.getUpper()));
+        ++NumCallsRanged;
+        Changed = true;
+      }
+      DEBUG(if (Changed) dbgs() << F.getName() << " returns " << R << "\n");
+      return Changed;
+    }
+
+    bool run(Module &M, CallGraph &CG) {
+      // Bottom-up: callees before their callers
+      std::vector<Function *> Order;
+      SmallPtrSet<const Function *, 16> Recursive;
+      for (auto scc = scc_begin(&CG); !scc.isAtEnd(); ++scc) {
+        bool Loop = scc.hasLoop();
+        for (auto n = scc->begin(), e = scc->end(); n != e; ++n) {
+          Function *F = (*n)->getFunction();
+          if (!F || F->isDeclaration())
+            continue;
+          Order.push_back(F);
+          if (Loop)
+            Recursive.insert(F);
+        }
+      }
+      for (auto f = Order.begin(), e = Order.end(); f != e; ++f)
+        if (hasKnownCallers(**f) && !Recursive.count(*f))
+          Known.insert(*f);
+
+      bool Changed = false;
+      {
+        instr::PhaseTimer T("arguments", "iprange");
+        for (auto f = Order.rbegin(), e = Order.rend(); f != e; ++f) {
+          if (Known.count(*f))
+            Changed |= assumeArgRanges(**f);
+          RA.compute(**f);
+          collectArgRanges(**f);
+          RA.clear();
+        }
+      }
+      {
+        instr::PhaseTimer T("returns", "iprange");
+        for (auto f = Order.begin(), e = Order.end(); f != e; ++f) {
+          if (!(*f)->getReturnType()->isIntegerTy() || !(*f)->hasExactDefinition())
+            continue;
+          RA.compute(**f);
+          Changed |= rangeCalls(**f);
+          RA.clear();
+        }
+      }
+      Known.clear();
+      ArgRanges.clear();
+      return Changed;
+    }
+  };
+
+  struct IPRange : public ModulePass {
+    static char ID;
+    IPRange() : ModulePass(ID) {}
+
+    void getAnalysisUsage(AnalysisUsage& AU) const override {
+      AU.addRequired<CallGraphWrapperPass>();
+      // Only straight-line code and metadata are added
+      AU.setPreservesCFG();
+    }
+
+    bool runOnModule(Module &M) override {
+      IPRangeImpl Impl;
+      Impl.ACT = getAnalysisIfAvailable<AssumptionCacheTracker>();
+      return Impl.run(M, getAnalysis<CallGraphWrapperPass>().getCallGraph());
+    }
+  };
+}
+
+char IPRange::ID = 0;
+static RegisterPass<IPRange> X("iprange", "Propagate integer ranges across calls", false, false);
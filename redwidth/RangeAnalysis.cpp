@@ -0,0 +1,418 @@
+#include "redwidth/RangeAnalysis.h"
+
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/Analysis/CFG.h"
+#include "llvm/Analysis/ValueTracking.h"
+
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+
+#include <iterator>
+
+using namespace llvm;
+using namespace redwidth;
+
+// Updates of a loop header phi before it is widened, and of any other value
+static const unsigned WidenAfter = 3;
+static const unsigned MaxUpdates = 16;
+// Descending sweeps after the fixpoint
+static const unsigned NarrowSweeps = 2;
+
+// The signed interval [Lo, Hi]
+static ConstantRange getSignedRange(const APInt &Lo, const APInt &Hi) {
+  if (Lo.isMinSignedValue() && Hi.isMaxSignedValue())
+    return ConstantRange(Lo.getBitWidth(), true);
+  return ConstantRange(Lo, Hi + 1);
+}
+
+// A + B or A - B, saturated at the signed bounds. Where the instruction
+// has no signed wrap, results past the bounds are poison and clamping them
+// keeps the range tight.
+static APInt addSaturated(const APInt &A, const APInt &B, bool Sub) {
+  bool Overflow;
+  APInt R = Sub ? A.ssub_ov(B, Overflow) : A.sadd_ov(B, Overflow);
+  if (!Overflow)
+    return R;
+  bool Up = Sub ? B.isNegative() : !B.isNegative();
+  return Up ? APInt::getSignedMaxValue(A.getBitWidth())
+            : APInt::getSignedMinValue(A.getBitWidth());
+}
+
+static ConstantRange addNoSignedWrap(const ConstantRange &L, const ConstantRange &R,
+                                     bool Sub) {
+  APInt Lo = addSaturated(L.getSignedMin(), Sub ? R.getSignedMax() : R.getSignedMin(), Sub);
+  APInt Hi = addSaturated(L.getSignedMax(), Sub ? R.getSignedMin() : R.getSignedMax(), Sub);
+  return getSignedRange(Lo, Hi);
+}
+
+// Grows the bounds that moved since Old to the extremes of the type
+static ConstantRange widen(const ConstantRange &Old, const ConstantRange &New) {
+  unsigned BW = New.getBitWidth();
+  APInt Lo = New.getSignedMin(), Hi = New.getSignedMax();
+  if (Lo.slt(Old.getSignedMin()))
+    Lo = APInt::getSignedMinValue(BW);
+  if (Hi.sgt(Old.getSignedMax()))
+    Hi = APInt::getSignedMaxValue(BW);
+  return getSignedRange(Lo, Hi);
+}
+
+void RangeAnalysis::clear() {
+  Ranges.clear();
+  Assumed.clear();
+  Updates.clear();
+  Executable.clear();
+  Edges.clear();
+  LoopHeaders.clear();
+  Worklist.clear();
+}
+
+// The range of a constant vector covers all of its lanes. Undefined lanes
+// may hold anything, so they are left out.
+static ConstantRange getLanesRange(const Constant *C, unsigned BW) {
+  ConstantRange R(BW, false);
+  for (unsigned i = 0, e = C->getType()->getVectorNumElements(); i != e; ++i) {
+    const Constant *Elt = C->getAggregateElement(i);
+    if (const ConstantInt *CI = dyn_cast_or_null<ConstantInt>(Elt))
+      R = R.unionWith(ConstantRange(CI->getValue()));
+    else if (!Elt || !isa<UndefValue>(Elt))
+      return ConstantRange(BW, true);
+  }
+  return R;
+}
+
+// The range of a vector is the range of its lanes taken together
+ConstantRange RangeAnalysis::getState(const Value *V) const {
+  unsigned BW = V->getType()->getScalarSizeInBits();
+  if (const ConstantInt *CI = dyn_cast<ConstantInt>(V))
+    return ConstantRange(CI->getValue());
+  if (V->getType()->isVectorTy() && isa<Constant>(V))
+    return getLanesRange(cast<Constant>(V), BW);
+  auto it = Ranges.find(V);
+  if (it != Ranges.end())
+    return it->second;
+  // Instructions are unknown until reached; arguments hold what the entry
+  // assumes allow, and anything else may hold any value
+  if (isa<Argument>(V)) {
+    auto a = Assumed.find(V);
+    if (a != Assumed.end())
+      return a->second;
+  }
+  return ConstantRange(BW, !isa<Instruction>(V));
+}
+
+ConstantRange RangeAnalysis::getRange(const Value *V) const {
+  ConstantRange R = getState(V);
+  if (R.isEmptySet())
+    return ConstantRange(R.getBitWidth(), true);
+  return R;
+}
+
+void RangeAnalysis::copyRange(const Value *From, Value *To) {
+  if (!To->getType()->isIntOrIntVectorTy())
+    return;
+  ConstantRange R = getRange(From);
+  unsigned BW = To->getType()->getScalarSizeInBits();
+  if (BW < R.getBitWidth())
+    R = R.truncate(BW);
+  else if (BW > R.getBitWidth())
+    R = isa<ZExtInst>(To) ? R.zeroExtend(BW) : R.signExtend(BW);
+  Ranges.erase(To);
+  Ranges.insert(std::make_pair(To, R));
+}
+
+void RangeAnalysis::forget(const Value *V) {
+  Ranges.erase(V);
+  Assumed.erase(V);
+  Updates.erase(V);
+}
+
+// The range V has on the edge From -> To, narrowed by the compare the edge
+// is taken on. While ascending only constant bounds are used, since the
+// phi would not be revisited when a bound computed elsewhere grows.
+ConstantRange RangeAnalysis::getIncoming(const Value *V, BasicBlock *From,
+                                         BasicBlock *To, bool AnyBound) const {
+  ConstantRange R = getState(V);
+  BranchInst *BI = dyn_cast<BranchInst>(From->getTerminator());
+  if (!BI || !BI->isConditional() || BI->getSuccessor(0) == BI->getSuccessor(1))
+    return R;
+  ICmpInst *Cmp = dyn_cast<ICmpInst>(BI->getCondition());
+  if (!Cmp)
+    return R;
+  CmpInst::Predicate Pred = Cmp->getPredicate();
+  if (To == BI->getSuccessor(1))
+    Pred = CmpInst::getInversePredicate(Pred);
+  Value *Bound;
+  if (Cmp->getOperand(0) == V) {
+    Bound = Cmp->getOperand(1);
+  } else if (Cmp->getOperand(1) == V) {
+    Bound = Cmp->getOperand(0);
+    Pred = CmpInst::getSwappedPredicate(Pred);
+  } else {
+    return R;
+  }
+  if (!AnyBound && !isa<ConstantInt>(Bound))
+    return R;
+  ConstantRange B = getState(Bound);
+  if (B.isEmptySet())
+    return R;
+  return R.intersectWith(ConstantRange::makeAllowedICmpRegion(Pred, B));
+}
+
+ConstantRange RangeAnalysis::transfer(Instruction *I, bool AnyBound) const {
+  unsigned BW = I->getType()->getScalarSizeInBits();
+  ConstantRange Full(BW, true), Empty(BW, false);
+
+  if (PHINode *P = dyn_cast<PHINode>(I)) {
+    ConstantRange R = Empty;
+    for (unsigned i = 0, e = P->getNumIncomingValues(); i != e; ++i) {
+      BasicBlock *From = P->getIncomingBlock(i);
+      if (Edges.count(std::make_pair(From, P->getParent())))
+        R = R.unionWith(getIncoming(P->getIncomingValue(i), From, P->getParent(), AnyBound));
+    }
+    return R;
+  }
+
+  if (BinaryOperator *BO = dyn_cast<BinaryOperator>(I)) {
+    ConstantRange L = getState(BO->getOperand(0)), R = getState(BO->getOperand(1));
+    if (L.isEmptySet() || R.isEmptySet())
+      return Empty;
+    switch (BO->getOpcode()) {
+    case Instruction::Add:
+      return BO->hasNoSignedWrap() ? addNoSignedWrap(L, R, false) : L.add(R);
+    case Instruction::Sub:
+      return BO->hasNoSignedWrap() ? addNoSignedWrap(L, R, true) : L.sub(R);
+    case Instruction::Mul:  return L.multiply(R);
+    case Instruction::UDiv: return L.udiv(R);
+    case Instruction::Shl:  return L.shl(R);
+    case Instruction::LShr: return L.lshr(R);
+    case Instruction::And:  return L.binaryAnd(R);
+    case Instruction::Or:   return L.binaryOr(R);
+    default:                return Full;
+    }
+  }
+
+  if (CastInst *CI = dyn_cast<CastInst>(I)) {
+    if (!CI->getSrcTy()->isIntOrIntVectorTy())
+      return Full;
+    ConstantRange Src = getState(CI->getOperand(0));
+    switch (CI->getOpcode()) {
+    case Instruction::Trunc: return Src.truncate(BW);
+    case Instruction::ZExt:  return Src.zeroExtend(BW);
+    case Instruction::SExt:  return Src.signExtend(BW);
+    default:                 return Full;
+    }
+  }
+
+  if (SelectInst *SI = dyn_cast<SelectInst>(I)) {
+    ConstantRange C = getState(SI->getCondition());
+    if (C.isEmptySet())
+      return Empty;
+    if (const APInt *V = C.getSingleElement())
+      return getState(V->isOneValue() ? SI->getTrueValue() : SI->getFalseValue());
+    return getState(SI->getTrueValue()).unionWith(getState(SI->getFalseValue()));
+  }
+
+  if (ICmpInst *Cmp = dyn_cast<ICmpInst>(I)) {
+    if (!Cmp->getOperand(0)->getType()->isIntOrIntVectorTy())
+      return Full;
+    ConstantRange L = getState(Cmp->getOperand(0)), R = getState(Cmp->getOperand(1));
+    if (L.isEmptySet() || R.isEmptySet())
+      return Empty;
+    CmpInst::Predicate Pred = Cmp->getPredicate();
+    if (ConstantRange::makeSatisfyingICmpRegion(Pred, R).contains(L))
+      return ConstantRange(APInt(1, 1));
+    if (ConstantRange::makeSatisfyingICmpRegion(CmpInst::getInversePredicate(Pred), R).contains(L))
+      return ConstantRange(APInt(1, 0));
+    return Full;
+  }
+
+  // Lane moves keep the values of the lanes they move
+  if (isa<InsertElementInst>(I) || isa<ShuffleVectorInst>(I)) {
+    ConstantRange L = getState(I->getOperand(0)), R = getState(I->getOperand(1));
+    return L.unionWith(R);
+  }
+  if (isa<ExtractElementInst>(I))
+    return getState(I->getOperand(0));
+
+  if (isa<LoadInst>(I) || isa<CallInst>(I) || isa<InvokeInst>(I))
+    if (MDNode *MD = I->getMetadata(LLVMContext::MD_range))
+      return getConstantRangeFromMetadata(*MD);
+  return Full;
+}
+
+// An llvm.assume of a compare against a constant, reached without fail
+// from the definition it constrains, holds wherever that value is used.
+// For an argument, the assume must be reached from the function entry.
+void RangeAnalysis::collectAssumptions(Function &F) {
+  for (auto bb = F.begin(), be = F.end(); bb != be; ++bb) {
+    for (auto i = bb->begin(), ie = bb->end(); i != ie; ++i) {
+      IntrinsicInst *II = dyn_cast<IntrinsicInst>(&*i);
+      if (!II || II->getIntrinsicID() != Intrinsic::assume)
+        continue;
+      ICmpInst *Cmp = dyn_cast<ICmpInst>(II->getArgOperand(0));
+      if (!Cmp)
+        continue;
+      CmpInst::Predicate Pred = Cmp->getPredicate();
+      Value *Def = Cmp->getOperand(0);
+      ConstantInt *C = dyn_cast<ConstantInt>(Cmp->getOperand(1));
+      if (!C) {
+        Def = Cmp->getOperand(1);
+        C = dyn_cast<ConstantInt>(Cmp->getOperand(0));
+        Pred = CmpInst::getSwappedPredicate(Pred);
+      }
+      if (!C)
+        continue;
+      BasicBlock::iterator From;
+      if (Instruction *DefI = dyn_cast<Instruction>(Def)) {
+        if (DefI->getParent() != II->getParent())
+          continue;
+        From = std::next(DefI->getIterator());
+      } else if (isa<Argument>(Def) && II->getParent() == &F.getEntryBlock()) {
+        From = F.getEntryBlock().begin();
+      } else {
+        continue;
+      }
+
+      bool Reached = false;
+      for (auto n = From; n != ie; ++n) {
+        if (&*n == II) {
+          Reached = true;
+          break;
+        }
+        IntrinsicInst *Other = dyn_cast<IntrinsicInst>(&*n);
+        bool IsAssume = Other && Other->getIntrinsicID() == Intrinsic::assume;
+        if (!IsAssume && !isGuaranteedToTransferExecutionToSuccessor(&*n))
+          break;
+      }
+      if (!Reached)
+        continue;
+
+      ConstantRange R = ConstantRange::makeAllowedICmpRegion(Pred, ConstantRange(C->getValue()));
+      auto it = Assumed.find(Def);
+      if (it != Assumed.end())
+        it->second = it->second.intersectWith(R);
+      else
+        Assumed.insert(std::make_pair(Def, R));
+    }
+  }
+}
+
+void RangeAnalysis::findLoopHeaders(Function &F) {
+  SmallVector<std::pair<const BasicBlock *, const BasicBlock *>, 16> Backedges;
+  FindFunctionBackedges(F, Backedges);
+  for (auto e = Backedges.begin(), ee = Backedges.end(); e != ee; ++e)
+    LoopHeaders.insert(const_cast<BasicBlock *>(e->second));
+}
+
+void RangeAnalysis::markExecutable(BasicBlock *BB) {
+  if (!Executable.insert(BB).second)
+    return;
+  // Pushed backwards, so that they come off the worklist in order
+  for (auto i = BB->rbegin(), e = BB->rend(); i != e; ++i)
+    Worklist.push_back(&*i);
+}
+
+void RangeAnalysis::markEdge(BasicBlock *From, BasicBlock *To) {
+  if (!Edges.insert(std::make_pair(From, To)).second)
+    return;
+  if (!Executable.count(To)) {
+    markExecutable(To);
+    return;
+  }
+  for (auto i = To->begin(); PHINode *P = dyn_cast<PHINode>(&*i); ++i)
+    Worklist.push_back(P);
+}
+
+void RangeAnalysis::visitTerminator(Instruction *I) {
+  BasicBlock *BB = I->getParent();
+  if (BranchInst *BI = dyn_cast<BranchInst>(I)) {
+    if (BI->isConditional()) {
+      ConstantRange C = getState(BI->getCondition());
+      if (C.isEmptySet())
+        return;
+      if (const APInt *V = C.getSingleElement()) {
+        markEdge(BB, BI->getSuccessor(V->isOneValue() ? 0 : 1));
+        return;
+      }
+    }
+  } else if (SwitchInst *SI = dyn_cast<SwitchInst>(I)) {
+    ConstantRange C = getState(SI->getCondition());
+    if (C.isEmptySet())
+      return;
+    if (const APInt *V = C.getSingleElement()) {
+      auto Case = SI->findCaseValue(ConstantInt::get(SI->getContext(), *V));
+      markEdge(BB, Case->getCaseSuccessor());
+      return;
+    }
+  }
+  for (auto s = succ_begin(BB), e = succ_end(BB); s != e; ++s)
+    markEdge(BB, *s);
+}
+
+void RangeAnalysis::update(Instruction *I, ConstantRange R) {
+  auto a = Assumed.find(I);
+  if (a != Assumed.end())
+    R = R.intersectWith(a->second);
+  auto it = Ranges.find(I);
+  if (it == Ranges.end())
+    it = Ranges.insert(std::make_pair(I, ConstantRange(R.getBitWidth(), false))).first;
+  ConstantRange &Old = it->second;
+  if (Old.contains(R))
+    return;
+
+  ConstantRange New = Old.unionWith(R);
+  unsigned N = ++Updates[I];
+  if (!Old.isEmptySet() &&
+      ((isa<PHINode>(I) && LoopHeaders.count(I->getParent()) && N > WidenAfter) ||
+       N > MaxUpdates))
+    New = widen(Old, New);
+  Old = New;
+
+  for (auto u = I->user_begin(), e = I->user_end(); u != e; ++u) {
+    Instruction *U = cast<Instruction>(*u);
+    if (Executable.count(U->getParent()))
+      Worklist.push_back(U);
+  }
+}
+
+// Recomputes every value from the fixpoint, keeping the tighter of the two
+// results, which undoes most of what widening gave away.
+void RangeAnalysis::narrow(Function &F) {
+  ReversePostOrderTraversal<Function *> RPOT(&F);
+  for (unsigned Sweep = 0; Sweep < NarrowSweeps; ++Sweep) {
+    for (auto bb = RPOT.begin(), be = RPOT.end(); bb != be; ++bb) {
+      if (!Executable.count(*bb))
+        continue;
+      for (auto i = (*bb)->begin(), e = (*bb)->end(); i != e; ++i) {
+        if (!i->getType()->isIntOrIntVectorTy())
+          continue;
+        ConstantRange R = transfer(&*i, true);
+        auto a = Assumed.find(&*i);
+        if (a != Assumed.end())
+          R = R.intersectWith(a->second);
+        auto it = Ranges.find(&*i);
+        if (it != Ranges.end())
+          it->second = it->second.intersectWith(R);
+      }
+    }
+  }
+}
+
+void RangeAnalysis::compute(Function &F) {
+  clear();
+  findLoopHeaders(F);
+  collectAssumptions(F);
+
+  markExecutable(&F.getEntryBlock());
+  while (!Worklist.empty()) {
+    Instruction *I = Worklist.pop_back_val();
+    if (I->isTerminator())
+      visitTerminator(I);
+    if (I->getType()->isIntOrIntVectorTy())
+      update(I, transfer(I, false));
+  }
+  narrow(F);
+}
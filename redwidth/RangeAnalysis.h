@@ -0,0 +1,71 @@
+#ifndef REDWIDTH_RANGEANALYSIS_H
+#define REDWIDTH_RANGEANALYSIS_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/ConstantRange.h"
+
+#include <utility>
+
+namespace llvm {
+  class BasicBlock;
+  class Function;
+  class Instruction;
+  class Value;
+}
+
+namespace redwidth {
+  // The range of every integer value of a function, computed once and
+  // answered in constant time. Each range holds both the signed and the
+  // unsigned bounds. An integer vector has one range, covering all lanes.
+  //
+  // Ranges are propagated sparsely along def-use edges, SCCP style: values
+  // start out empty, blocks and CFG edges only count once they are found
+  // executable, and a branch on a known condition only enables the taken
+  // edge. Phi operands are narrowed by the compare that guards their edge,
+  // and llvm.assume calls right after a definition narrow it everywhere.
+  // Assumes at the top of the entry block do the same for arguments.
+  // Phis that keep growing at a loop header are widened to the extreme of
+  // the type, after which a couple of descending sweeps win back the bounds
+  // that loop exits imply.
+  //
+  // Results are per value, not per program point. Rewrites keep them valid
+  // through copyRange and forget.
+  class RangeAnalysis {
+  public:
+    void compute(llvm::Function &F);
+    void clear();
+
+    // Full set for values that were not analysed or never executed
+    llvm::ConstantRange getRange(const llvm::Value *V) const;
+
+    // To now computes the value of From, possibly at another width
+    void copyRange(const llvm::Value *From, llvm::Value *To);
+    void forget(const llvm::Value *V);
+
+  private:
+    llvm::ConstantRange getState(const llvm::Value *V) const;
+    llvm::ConstantRange transfer(llvm::Instruction *I, bool AnyBound) const;
+    llvm::ConstantRange getIncoming(const llvm::Value *V, llvm::BasicBlock *From,
+                                    llvm::BasicBlock *To, bool AnyBound) const;
+    void collectAssumptions(llvm::Function &F);
+    void findLoopHeaders(llvm::Function &F);
+    void markExecutable(llvm::BasicBlock *BB);
+    void markEdge(llvm::BasicBlock *From, llvm::BasicBlock *To);
+    void visitTerminator(llvm::Instruction *I);
+    void update(llvm::Instruction *I, llvm::ConstantRange R);
+    void narrow(llvm::Function &F);
+
+    llvm::DenseMap<const llvm::Value *, llvm::ConstantRange> Ranges;
+    llvm::DenseMap<const llvm::Value *, llvm::ConstantRange> Assumed;
+    llvm::DenseMap<const llvm::Value *, unsigned> Updates;
+    llvm::SmallPtrSet<llvm::BasicBlock *, 32> Executable;
+    llvm::DenseSet<std::pair<llvm::BasicBlock *, llvm::BasicBlock *>> Edges;
+    llvm::SmallPtrSet<llvm::BasicBlock *, 8> LoopHeaders;
+    llvm::SmallVector<llvm::Instruction *, 64> Worklist;
+  };
+}
+
+#endif
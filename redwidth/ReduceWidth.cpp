@@ -1,272 +1,714 @@
 #include "llvm/Pass.h"
 
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/EquivalenceClasses.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/DataLayout.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/DerivedTypes.h"
-#include "llvm/Analysis/LazyValueInfo.h"
 #include "llvm/IR/ConstantRange.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/Instructions.h"
 
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/MathExtras.h"
 #include "llvm/Support/raw_ostream.h"
 
-using namespace llvm;
+#include "common/Instrumentation.h"
+#include "minreg/Liveness.h"
+#include "minreg/RegPressure.h"
+#include "redwidth/RangeAnalysis.h"
 
-#define DEBUG_TYPE "reduce-width"
+#include <utility>
 
-namespace {
-  struct ReduceWidth : public FunctionPass {
-    static char ID;
-    ReduceWidth() : FunctionPass(ID) {}
+using namespace llvm;
 
-    LazyValueInfo *LVI;
+#define DEBUG_TYPE "reduce-width"
 
-    void getAnalysisUsage(AnalysisUsage& AU) const override {
-      AU.addRequired<LazyValueInfoWrapperPass>();
-    }
+static cl::opt<unsigned> MinWidth("redwidth-min-width",
+    cl::desc("Narrowest integer width to consider, a power of two"),
+    cl::init(8));
+
+static cl::opt<bool> IgnoreCost("redwidth-ignore-cost",
+    cl::desc("Narrow every web that fits, whatever its casts cost"),
+    cl::init(false));
+
+STATISTIC(NumNarrowed, "Number of instructions narrowed");
+STATISTIC(NumNarrowed8, "Number of instructions narrowed to 8 bits");
+STATISTIC(NumNarrowed16, "Number of instructions narrowed to 16 bits");
+STATISTIC(NumNarrowedVector, "Number of vector instructions narrowed lane-wise");
+STATISTIC(NumNarrowedUnsigned, "Number of instructions narrowed with zext");
+STATISTIC(NumNarrowIndices, "Number of GEP indices left narrow");
+STATISTIC(NumWebs, "Number of webs narrowed");
+STATISTIC(NumWebsRejected, "Number of webs left wide as unprofitable");
+STATISTIC(NumCastsInserted, "Number of casts inserted");
+STATISTIC(NumCastsRemoved, "Number of dead casts removed");
 
-    // Returns a value equal to original, with the target type
-    Value *convertSize(Value *original, Type *target) {
-      assert(original->getType()->isIntegerTy());
-      if(original->getType()->getIntegerBitWidth() == target->getIntegerBitWidth())
+namespace {
+  // The pass itself, run by the legacy pass wrapper below
+  struct ReduceWidthImpl {
+    redwidth::RangeAnalysis RA;
+    OptimizationRemarkEmitter *ORE;
+    const TargetTransformInfo *TTI;
+    const DataLayout *DL;
+    // Values this run narrowed or created; only their extensions into GEP
+    // indices are folded
+    SmallPtrSet<Value *, 32> NewValues;
+
+    // Returns a value equal to original, with the target type. Narrowing
+    // truncates; widening extends as Signed says. Vectors are converted
+    // lane by lane.
+    Value *convertSize(Value *original, Type *target, bool Signed) {
+      assert(original->getType()->isIntOrIntVectorTy());
+      unsigned To = target->getScalarSizeInBits();
+      if(original->getType()->getScalarSizeInBits() == To)
         return original;
+      bool Narrowing = original->getType()->getScalarSizeInBits() > To;
 
-      if (CastInst *cast = dyn_cast<CastInst>(original)) {
+      CastInst *cast = dyn_cast<CastInst>(original);
+      if (cast && (isa<TruncInst>(cast) || isa<ZExtInst>(cast) || isa<SExtInst>(cast))) {
         Value *orig = cast->getOperand(0);
-        if (orig->getType() == target) {
-          // Stop using the cast entirely
-          return orig;
-        }
-        if (orig->getType()->isIntegerTy()) {
-          // Use this as the source value instead
-          original = orig;
+        if (Narrowing) {
+          unsigned From = orig->getType()->getScalarSizeInBits();
+          if (From == To) {
+            // Stop using the cast entirely
+            return orig;
+          }
+          if (From > To) {
+            // Truncate the source instead
+            original = orig;
+          } else if (isa<ZExtInst>(cast) || isa<SExtInst>(cast)) {
+            // Extend the source less far, the same way
+            Signed = isa<SExtInst>(cast);
+            original = orig;
+            Narrowing = false;
+          }
         }
       }
 
-      if (ConstantInt *ci = dyn_cast<ConstantInt>(original)) {
-        //TODO: assert if invalid
-        return ConstantInt::get(target, ci->getSExtValue(), true);
-      }
+      Instruction::CastOps Op = Narrowing ? Instruction::Trunc
+                              : Signed ? Instruction::SExt : Instruction::ZExt;
+      if (Constant *c = dyn_cast<Constant>(original))
+        return ConstantExpr::getCast(Op, c, target);
 
+      cast = CastInst::Create(Op, original, target);
       if (Instruction *i = dyn_cast<Instruction>(original)) {
-        CastInst *cast;
-        if(i->getType()->getIntegerBitWidth() > target->getIntegerBitWidth())
-          cast = CastInst::CreateTruncOrBitCast(i, target);
-        else
-          cast = CastInst::CreateSExtOrBitCast(i, target);
-
         if (isa<PHINode>(i)) {
           // must not insert a non-PHI instruction before a PHI
           cast->insertBefore(i->getParent()->getFirstNonPHI());
         } else {
           cast->insertAfter(i);
         }
-        return cast;
+      } else if (Argument *a = dyn_cast<Argument>(original)) {
+        cast->insertBefore(&*a->getParent()->getEntryBlock().getFirstInsertionPt());
+      } else {
+        llvm_unreachable("Tried to convert unknown value's type");
       }
-      llvm_unreachable("Tried to convert unknown value's type");
+      ++NumCastsInserted;
+      NewValues.insert(cast);
+      RA.copyRange(original, cast);
+      return cast;
     }
 
-    bool canConvertOperands(unsigned Width, Instruction* i) {
-      for (auto op = i->op_begin(), e = i->op_end(); op != e; ++op)
-        if (!canConvertToInt(Width, op->get(), i))
-          return false;
-      return true;
+    static bool fitsSigned(const ConstantRange &cr, unsigned Width) {
+      unsigned BW = cr.getBitWidth();
+      return cr.getSignedMin().sge(APInt::getSignedMinValue(Width).sext(BW)) &&
+             cr.getSignedMax().sle(APInt::getSignedMaxValue(Width).sext(BW));
     }
 
-    bool canConvertToInt(unsigned Width, Value *v, Instruction *context) {
-      assert(LVI != nullptr);
-      assert(v != nullptr);
+    static bool fitsUnsigned(const ConstantRange &cr, unsigned Width) {
+      return cr.getUnsignedMax().ule(APInt::getMaxValue(Width).zext(cr.getBitWidth()));
+    }
 
-      if(ICmpInst *cmp = dyn_cast<ICmpInst>(v))
-        // Compares don't generate ints, but can still be
-        // downsized to use smaller inputs where possible
-        return canConvertOperands(Width, cmp);
+    // Operations whose low bits only depend on the low bits of their
+    // operands, so that they can work on truncated inputs. Shifts only
+    // qualify for some widths; see shiftFits.
+    static bool isNarrowable(Value *v) {
+      if (BinaryOperator *BO = dyn_cast<BinaryOperator>(v)) {
+        switch (BO->getOpcode()) {
+        case Instruction::Add:
+        case Instruction::Sub:
+        case Instruction::Mul:
+        case Instruction::And:
+        case Instruction::Or:
+        case Instruction::Xor:
+        case Instruction::Shl:
+        case Instruction::LShr:
+        case Instruction::AShr:
+          return true;
+        default:
+          return false;
+        }
+      }
+      // Lane moves work at any width
+      return isa<SelectInst>(v) || isa<PHINode>(v) || isa<InsertElementInst>(v) ||
+             isa<ExtractElementInst>(v) || isa<ShuffleVectorInst>(v);
+    }
 
-      if(!v->getType()->isIntegerTy())
-        // Integers only
-        return false;
-      if(v->getType()->getIntegerBitWidth() <= Width)
-        // Already sufficiently small
-        return false;
+    // WideTy with its integers, or the integers of its lanes, W bits wide
+    static Type *getNarrowType(Type *WideTy, unsigned W) {
+      Type *IntTy = IntegerType::get(WideTy->getContext(), W);
+      if (WideTy->isVectorTy())
+        return VectorType::get(IntTy, WideTy->getVectorNumElements());
+      return IntTy;
+    }
 
-      ConstantRange cr = LVI->getConstantRange(v, context->getParent(), context);
-      if (!cr.getSignedMin().sge(APInt::getSignedMinValue(Width)
-                                 .sext(v->getType()->getIntegerBitWidth()))
-       || !cr.getSignedMax().sle(APInt::getSignedMaxValue(Width)
-                                 .sext(v->getType()->getIntegerBitWidth())))
-        // Unable to fit in an integer of size Width
+    // Can shift I be done at width W? The amount must stay below W. Left
+    // shifts keep their low bits; right shifts bring high bits down, so
+    // the shifted value must fit W the way the shift reads it.
+    bool shiftFits(Instruction *I, unsigned W) {
+      if (!I->isShift())
+        return true;
+      ConstantRange Amount = RA.getRange(I->getOperand(1));
+      if (!Amount.getUnsignedMax().ult(W))
         return false;
+      ConstantRange cr = RA.getRange(I->getOperand(0));
+      switch (I->getOpcode()) {
+      case Instruction::LShr:
+        return fitsUnsigned(cr, W);
+      case Instruction::AShr:
+        return fitsSigned(cr, W);
+      default:
+        return true;
+      }
+    }
 
-      return (isa<BinaryOperator>(v) ||
-              isa<SelectInst>(v) ||
-              isa<PHINode>(v));
+    // Does the target compute I at width W at least as cheaply as at its
+    // own width? With no integer widths in the data layout, scalar i16 and
+    // i32 are taken to be legal, as before there was a choice. Vectors must
+    // be legal for the target at the new lane width, since twice the lanes
+    // then fit a register only if the narrow vector is not split.
+    bool isFastWidth(Instruction *I, Type *WideTy, unsigned W) {
+      Type *NarrowTy = getNarrowType(WideTy, W);
+      bool Legal = TTI->isTypeLegal(NarrowTy) ||
+                   (!WideTy->isVectorTy() &&
+                    (DL->isLegalInteger(W) ||
+                     (DL->getLargestLegalIntTypeSizeInBits() == 0 && (W == 16 || W == 32))));
+      return Legal && getCost(I, NarrowTy) <= getCost(I, WideTy);
     }
 
-    Instruction *convertBinaryOperator(BinaryOperator *BO, Type *target) {
+    // What I costs with its integers of type Ty. Phis and lane moves are
+    // taken as free at any width.
+    int getCost(Instruction *I, Type *Ty) {
+      if (isa<BinaryOperator>(I))
+        return TTI->getArithmeticInstrCost(I->getOpcode(), Ty);
+      if (isa<SelectInst>(I) || isa<ICmpInst>(I))
+        return TTI->getCmpSelInstrCost(I->getOpcode(), Ty, CmpInst::makeCmpResultType(Ty));
+      return 0;
+    }
+
+    // Can a compare or lane move take operand v at width W, extended as
+    // Signed says, without extra work? Constants and values narrowed
+    // themselves can, as can extensions from W bits or fewer.
+    static bool isOperandFree(Value *v, unsigned W, bool Signed) {
+      if (isa<Constant>(v))
+        return true;
+      if (CastInst *cast = dyn_cast<CastInst>(v))
+        return (Signed ? isa<SExtInst>(cast) : isa<ZExtInst>(cast)) &&
+               cast->getSrcTy()->getScalarSizeInBits() <= W;
+      return isNarrowable(v);
+    }
+
+    // The operands convertInstruction converts, as [first, last). Select
+    // conditions, element indices and shuffle masks keep their type.
+    static std::pair<unsigned, unsigned> getConvertedOperands(Instruction *I) {
+      if (isa<SelectInst>(I))
+        return std::make_pair(1u, 3u);
+      if (isa<ExtractElementInst>(I))
+        return std::make_pair(0u, 1u);
+      if (isa<PHINode>(I))
+        return std::make_pair(0u, I->getNumOperands());
+      return std::make_pair(0u, 2u);
+    }
+
+    // Picks the narrowest fast type that I fits in, and whether the result
+    // is extended back with sext or zext.
+    bool chooseWidth(Instruction *I, Type *&Target, bool &Signed) {
+      ICmpInst *cmp = dyn_cast<ICmpInst>(I);
+      bool Move = isa<InsertElementInst>(I) || isa<ExtractElementInst>(I) ||
+                  isa<ShuffleVectorInst>(I);
+      Type *WideTy = cmp ? cmp->getOperand(0)->getType() : I->getType();
+      if (!WideTy->isIntOrIntVectorTy() || (!cmp && !isNarrowable(I)))
+        return false;
+      unsigned BW = WideTy->getScalarSizeInBits();
+      std::pair<unsigned, unsigned> Ops = getConvertedOperands(I);
+
+      for (unsigned W = MinWidth; W < BW; W *= 2) {
+        bool S, U;
+        if (cmp || Move) {
+          // Compares don't generate ints, but can still be
+          // downsized to use smaller inputs where possible. The
+          // operands must fit the way the predicate reads them.
+          // Truncating a vector just to move its lanes gains
+          // nothing, so lane moves also want narrow inputs.
+          S = !cmp || !cmp->isUnsigned();
+          U = !cmp || !cmp->isSigned();
+          for (unsigned op = Ops.first; op < Ops.second; ++op) {
+            Value *v = I->getOperand(op);
+            if (isa<UndefValue>(v))
+              continue;
+            ConstantRange cr = RA.getRange(v);
+            S = S && fitsSigned(cr, W) && isOperandFree(v, W, true);
+            U = U && fitsUnsigned(cr, W) && isOperandFree(v, W, false);
+          }
+        } else {
+          ConstantRange cr = RA.getRange(I);
+          S = fitsSigned(cr, W);
+          U = fitsUnsigned(cr, W);
+        }
+        if ((S || U) && shiftFits(I, W) && isFastWidth(I, WideTy, W)) {
+          Target = getNarrowType(WideTy, W);
+          // Non-negative values take zext, which is free more often
+          Signed = !U;
+          return true;
+        }
+      }
+      return false;
+    }
+
+    Instruction *convertBinaryOperator(BinaryOperator *BO, Type *target, bool Signed) {
       // get new operands of the required size
-      Value *op0 = convertSize(BO->getOperand(0), target);
-      Value *op1 = convertSize(BO->getOperand(1), target);
+      Value *op0 = convertSize(BO->getOperand(0), target, Signed);
+      Value *op1 = convertSize(BO->getOperand(1), target, Signed);
       return BinaryOperator::Create(BO->getOpcode(), op0, op1, BO->getName(), BO);
     }
 
-    Instruction *convertPHINode(PHINode *P, Type *target) {
+    Instruction *convertPHINode(PHINode *P, Type *target, bool Signed) {
       PHINode *newP = PHINode::Create(target, P->getNumOperands(), P->getName(), P);
       for(unsigned i = 0; i < P->getNumOperands(); i++) {
-        newP->addIncoming(convertSize(P->getIncomingValue(i), target),
+        newP->addIncoming(convertSize(P->getIncomingValue(i), target, Signed),
                           P->getIncomingBlock(i));
       }
       return newP;
     }
 
-    Instruction *convertICmp(ICmpInst *I, Type *target) {
+    Instruction *convertICmp(ICmpInst *I, Type *target, bool Signed) {
       // get new operands of the required size
-      Value *op0 = convertSize(I->getOperand(0), target);
-      Value *op1 = convertSize(I->getOperand(1), target);
+      Value *op0 = convertSize(I->getOperand(0), target, Signed);
+      Value *op1 = convertSize(I->getOperand(1), target, Signed);
       return new ICmpInst(I, I->getPredicate(), op0, op1, I->getName());
     }
 
-    Instruction *convertSelect(SelectInst *I, Type *target) {
+    Instruction *convertSelect(SelectInst *I, Type *target, bool Signed) {
       // get new operands of the required size
-      Value *op1 = convertSize(I->getOperand(1), target);
-      Value *op2 = convertSize(I->getOperand(2), target);
+      Value *op1 = convertSize(I->getOperand(1), target, Signed);
+      Value *op2 = convertSize(I->getOperand(2), target, Signed);
       return SelectInst::Create(I->getOperand(0), op1, op2, I->getName(), I);
     }
 
+    Instruction *convertInsertElement(InsertElementInst *I, Type *target, bool Signed) {
+      Value *vec = convertSize(I->getOperand(0), target, Signed);
+      Value *elt = convertSize(I->getOperand(1), target->getScalarType(), Signed);
+      return InsertElementInst::Create(vec, elt, I->getOperand(2), I->getName(), I);
+    }
+
+    Instruction *convertExtractElement(ExtractElementInst *I, Type *target, bool Signed) {
+      Type *vecTy = getNarrowType(I->getVectorOperandType(), target->getScalarSizeInBits());
+      Value *vec = convertSize(I->getVectorOperand(), vecTy, Signed);
+      return ExtractElementInst::Create(vec, I->getIndexOperand(), I->getName(), I);
+    }
+
+    Instruction *convertShuffleVector(ShuffleVectorInst *I, Type *target, bool Signed) {
+      // The inputs may have a different number of lanes than the result
+      Type *opTy = getNarrowType(I->getOperand(0)->getType(), target->getScalarSizeInBits());
+      Value *op0 = convertSize(I->getOperand(0), opTy, Signed);
+      Value *op1 = convertSize(I->getOperand(1), opTy, Signed);
+      return new ShuffleVectorInst(op0, op1, I->getMask(), I->getName(), I);
+    }
+
+    // How an instruction is narrowed
+    struct Choice {
+      Type *Target;
+      bool Signed;
+    };
+
+    // The instructions of the webs worth narrowing, in program order
+    DenseMap<Instruction *, Choice> Plan;
+    SmallVector<Instruction *, 64> Planned;
+
+    // Scalar width of the type V is planned to narrow to, or 0
+    static unsigned getPlannedWidth(const DenseMap<Instruction *, Choice> &Choices,
+                                    Value *V) {
+      Instruction *I = dyn_cast<Instruction>(V);
+      if (!I)
+        return 0;
+      auto it = Choices.find(I);
+      return it == Choices.end() ? 0 : it->second.Target->getScalarSizeInBits();
+    }
+
+    int getCastCost(unsigned Opcode, Type *Dst, Type *Src) {
+      return TTI->getCastInstrCost(Opcode, Dst, Src);
+    }
+
+    // Registers a value of type Ty takes, at the width TTI reports
+    unsigned getNumRegs(Type *Ty) {
+      unsigned RegBits = TTI->getRegisterBitWidth(Ty->isVectorTy());
+      if (!RegBits)
+        return 1;
+      return (DL->getTypeSizeInBits(Ty) + RegBits - 1) / RegBits;
+    }
+
+    // What narrowing the web costs in casts, less what it saves: cheaper
+    // instructions, registers, and extensions into the web that are no
+    // longer needed. A register is worth an instruction.
+    // Each value narrowed at a different width than its user, and each
+    // value not narrowed, is cast on the way in; each narrowed value with
+    // a user outside the web is extended once on the way out.
+    int getNetCost(ArrayRef<Instruction *> Web,
+                   const DenseMap<Instruction *, Choice> &Choices) {
+      int Cost = 0;
+      SmallPtrSet<Instruction *, 16> InWeb(Web.begin(), Web.end());
+      SmallPtrSet<Instruction *, 8> Freed;
+      for (auto w = Web.begin(), we = Web.end(); w != we; ++w) {
+        Instruction *I = *w;
+        const Choice &C = Choices.find(I)->second;
+        unsigned W = C.Target->getScalarSizeInBits();
+        Type *WideTy = isa<ICmpInst>(I) ? I->getOperand(0)->getType() : I->getType();
+        Cost -= getCost(I, WideTy) - getCost(I, C.Target);
+        if (!isa<ICmpInst>(I))
+          Cost -= getNumRegs(I->getType()) - getNumRegs(C.Target);
+
+        std::pair<unsigned, unsigned> Ops = getConvertedOperands(I);
+        for (unsigned op = Ops.first; op < Ops.second; ++op) {
+          Value *v = I->getOperand(op);
+          if (isa<Constant>(v) || getPlannedWidth(Choices, v) == W)
+            continue;
+          Type *NarrowTy = getNarrowType(v->getType(), W);
+          CastInst *Ext = dyn_cast<CastInst>(v);
+          if (Ext && (isa<ZExtInst>(Ext) || isa<SExtInst>(Ext)) &&
+              Ext->getSrcTy()->getScalarSizeInBits() <= W) {
+            // Extended from W bits or less, so read from the source
+            if (Ext->getSrcTy()->getScalarSizeInBits() < W)
+              Cost += getCastCost(Ext->getOpcode(), NarrowTy, Ext->getSrcTy());
+            bool Dead = true;
+            for (auto u = Ext->user_begin(), ue = Ext->user_end(); u != ue && Dead; ++u)
+              Dead = InWeb.count(cast<Instruction>(*u));
+            if (Dead && Freed.insert(Ext).second)
+              Cost -= getCastCost(Ext->getOpcode(), Ext->getDestTy(), Ext->getSrcTy());
+            continue;
+          }
+          Cost += getCastCost(Instruction::Trunc, NarrowTy, v->getType());
+        }
+
+        if (isa<ICmpInst>(I))
+          continue;
+        for (auto u = I->user_begin(), ue = I->user_end(); u != ue; ++u) {
+          // Planned users are in the web, being connected to I
+          if (getPlannedWidth(Choices, *u) != W) {
+            Cost += getCastCost(C.Signed ? Instruction::SExt : Instruction::ZExt,
+                                I->getType(), C.Target);
+            break;
+          }
+        }
+      }
+      return Cost;
+    }
+
+    // Groups the instructions that can be narrowed into webs, connected by
+    // def-use edges, and plans to narrow each web whose casts are paid for.
+    // A web that costs nothing extra is still narrowed, for its narrower
+    // registers.
+    void planWebs(Function &F) {
+      DenseMap<Instruction *, Choice> Choices;
+      EquivalenceClasses<Instruction *> Webs;
+      SmallVector<Instruction *, 64> Order;
+      for (auto bb = F.begin(), e = F.end(); bb != e; ++bb)
+        for (auto i = bb->begin(), e = bb->end(); i != e; ++i) {
+          Choice C;
+          if (!chooseWidth(&*i, C.Target, C.Signed))
+            continue;
+          Choices.insert(std::make_pair(&*i, C));
+          Order.push_back(&*i);
+          Webs.insert(&*i);
+        }
+      for (auto i = Order.begin(), e = Order.end(); i != e; ++i)
+        for (auto op = (*i)->op_begin(), oe = (*i)->op_end(); op != oe; ++op)
+          if (Instruction *Def = dyn_cast<Instruction>(op->get()))
+            if (Choices.count(Def))
+              Webs.unionSets(*i, Def);
+
+      for (auto i = Order.begin(), e = Order.end(); i != e; ++i) {
+        auto Leader = Webs.findValue(*i);
+        if (!Leader->isLeader())
+          continue;
+        SmallVector<Instruction *, 16> Web(Webs.member_begin(Leader), Webs.member_end());
+        int Cost = getNetCost(Web, Choices);
+        DEBUG(dbgs() << "Web of " << Web.size() << " at " << **i
+                     << ", net cost " << Cost << "\n");
+        if (Cost > 0 && !IgnoreCost) {
+          ORE->emit(OptimizationRemarkMissed(DEBUG_TYPE, "Unprofitable", *i)
+                    << "not narrowed: web of " << ore::NV("Size", (unsigned)Web.size())
+                    << " instructions needs casts costing "
+                    << ore::NV("NetCost", Cost) << " more than it saves");
+          ++NumWebsRejected;
+          continue;
+        }
+        ++NumWebs;
+        for (auto w = Web.begin(), we = Web.end(); w != we; ++w)
+          Plan.insert(*Choices.find(*w));
+      }
+      for (auto i = Order.begin(), e = Order.end(); i != e; ++i)
+        if (Plan.count(*i))
+          Planned.push_back(*i);
+    }
+
     // Generate a new instruction for i, while fulfilling our contract with users
-    void convertInstruction(Instruction *i, Type *target) {
+    void convertInstruction(Instruction *i, Type *target, bool Signed) {
       DEBUG(dbgs() << "Instruction Before Conversion: ");
       DEBUG(i->dump());
       Instruction *newInst = i;
       if (BinaryOperator *BO = dyn_cast<BinaryOperator>(i))
-        newInst = convertBinaryOperator(BO, target);
+        newInst = convertBinaryOperator(BO, target, Signed);
       else if (PHINode *P = dyn_cast<PHINode>(i))
-        newInst = convertPHINode(P, target);
+        newInst = convertPHINode(P, target, Signed);
       else if (ICmpInst *CMP = dyn_cast<ICmpInst>(i))
-        newInst = convertICmp(CMP, target);
+        newInst = convertICmp(CMP, target, Signed);
       else if (SelectInst *S = dyn_cast<SelectInst>(i))
-        newInst = convertSelect(S, target);
+        newInst = convertSelect(S, target, Signed);
+      else if (InsertElementInst *IE = dyn_cast<InsertElementInst>(i))
+        newInst = convertInsertElement(IE, target, Signed);
+      else if (ExtractElementInst *EE = dyn_cast<ExtractElementInst>(i))
+        newInst = convertExtractElement(EE, target, Signed);
+      else if (ShuffleVectorInst *SV = dyn_cast<ShuffleVectorInst>(i))
+        newInst = convertShuffleVector(SV, target, Signed);
 
       DEBUG(dbgs() << "Instruction After Conversion: ");
       DEBUG(newInst->dump());
+      RA.copyRange(i, newInst);
+      NewValues.insert(newInst);
 
       // Replace all uses of the instruction with an equivalent
-      Value *likeOld = convertSize(newInst, i->getType());
+      Value *likeOld = convertSize(newInst, i->getType(), Signed);
       DEBUG(dbgs() << "Equivalent for Users: ");
       DEBUG(likeOld->dump());
+      // Compares keep their i1 result and narrow their operands
+      Type *fromTy = isa<ICmpInst>(i) ? i->getOperand(0)->getType() : i->getType();
+      ORE->emit(OptimizationRemark(DEBUG_TYPE, "Narrowed", i)
+                << "narrowed from " << ore::NV("FromWidth", fromTy->getScalarSizeInBits())
+                << " to " << ore::NV("ToWidth", target->getScalarSizeInBits()) << " bits"
+                << " with " << ore::NV("Extension", Signed ? "sext" : "zext"));
+      ++NumNarrowed;
+      if (target->getScalarSizeInBits() == 8)
+        ++NumNarrowed8;
+      if (target->getScalarSizeInBits() == 16)
+        ++NumNarrowed16;
+      if (target->isVectorTy())
+        ++NumNarrowedVector;
+      if (!Signed)
+        ++NumNarrowedUnsigned;
       i->replaceAllUsesWith(likeOld);
+      // Users narrowed before i, like the phi of a loop induction variable,
+      // truncated it; they can take the narrow value directly
+      if (likeOld != newInst) {
+        SmallVector<TruncInst *, 4> Truncs;
+        for (auto u = likeOld->user_begin(), e = likeOld->user_end(); u != e; ++u)
+          if (TruncInst *T = dyn_cast<TruncInst>(*u))
+            if (T->getType() == target)
+              Truncs.push_back(T);
+        for (auto t = Truncs.begin(), e = Truncs.end(); t != e; ++t)
+          (*t)->replaceAllUsesWith(newInst);
+      }
       // Remove the old instruction
+      RA.forget(i);
       i->eraseFromParent();
     }
 
 
-    // In order to avoid worrying about the number of users of a given
-    // cast during the transformations, we defer cleanup until the end.
-    // This function removes any casts that no longer have any users.
-    bool removeDeadCasts(Function &F) {
-      bool didSomething = true;
-      while(didSomething) {
-        didSomething = false;
-        for (auto bb = F.begin(), e = F.end(); bb != e; ++bb) {
-          for (auto i = bb->begin(), e = bb->end(); i != e; ++i) {
-            if (CastInst *cast = dyn_cast<CastInst>(i)) {
-              if (cast->getNumUses() == 0) {
-                DEBUG(dbgs() << "Removing dead cast: \n");
-                cast->dump();
-                cast->eraseFromParent();
-                didSomething = true;
-                break;
-              }
-            }
+    // GEP indices narrower than the pointer are sign extended by the GEP
+    // itself, so an index this run narrowed can be used narrow instead of
+    // through the extension back to its old width. The extension then
+    // happens in the address computation, and the wide index is not kept
+    // live across the loop that computes it. Indices that were already
+    // extended are left to InstCombine, which widens them again.
+    bool foldIndexExtensions(Function &F) {
+      bool Changed = false;
+      for (auto bb = F.begin(), e = F.end(); bb != e; ++bb)
+        for (auto i = bb->begin(), e = bb->end(); i != e; ++i) {
+          GetElementPtrInst *GEP = dyn_cast<GetElementPtrInst>(i);
+          if (!GEP)
+            continue;
+          for (auto idx = GEP->idx_begin(), ie = GEP->idx_end(); idx != ie; ++idx) {
+            CastInst *cast = dyn_cast<CastInst>(idx->get());
+            if (!cast || !cast->getSrcTy()->isIntegerTy())
+              continue;
+            Value *src = cast->getOperand(0);
+            if (!NewValues.count(src))
+              continue;
+            // A zext is a sext when the value is never negative
+            if (!isa<SExtInst>(cast) &&
+                !(isa<ZExtInst>(cast) && RA.getRange(src).getSignedMin().isNonNegative()))
+              continue;
+            DEBUG(dbgs() << "Narrow index " << *src << " in " << *GEP << "\n");
+            idx->set(src);
+            ++NumNarrowIndices;
+            Changed = true;
           }
         }
+      return Changed;
+    }
+
+    // In order to avoid worrying about the number of users of a given
+    // cast during the transformations, we defer cleanup until the end.
+    // This function removes any casts that no longer have any users, in
+    // one sweep; a cast whose only user was a dead cast is followed up.
+    void removeDeadCasts(Function &F) {
+      SmallVector<CastInst *, 64> Dead;
+      for (auto bb = F.begin(), e = F.end(); bb != e; ++bb)
+        for (auto i = bb->begin(), e = bb->end(); i != e; ++i)
+          if (CastInst *cast = dyn_cast<CastInst>(i))
+            if (cast->use_empty())
+              Dead.push_back(cast);
+
+      while (!Dead.empty()) {
+        CastInst *cast = Dead.pop_back_val();
+        CastInst *src = dyn_cast<CastInst>(cast->getOperand(0));
+        DEBUG(dbgs() << "Removing dead cast: " << *cast << "\n");
+        RA.forget(cast);
+        cast->eraseFromParent();
+        ++NumCastsRemoved;
+        if (src && src->use_empty())
+          Dead.push_back(src);
       }
-      return didSomething;
     }
 
-    bool runOnFunction(Function &F) override {
-      LVI = &getAnalysis<LazyValueInfoWrapperPass>().getLVI();
-      LLVMContext &C = F.getContext();
-      Type *Int32Ty = IntegerType::getInt32Ty(C);
-      Type *Int16Ty = IntegerType::getInt16Ty(C);
-
-      bool didSomething = false;
-      bool didStIter = true;
-      while (didStIter) {
-        didStIter = false;
-        for (auto bb = F.begin(), e = F.end(); bb != e; ++bb) {
-          for (auto i = bb->begin(), e = bb->end(); i != e; ++i) {
-            Instruction *I = &*i;
-            if(canConvertToInt(16, I, I)) {
-              convertInstruction(I, Int16Ty);
-              didSomething = true;
-              didStIter = true;
-              break;
-            }
-            if(canConvertToInt(32, I, I)) {
-              convertInstruction(I, Int32Ty);
-              didSomething = true;
-              didStIter = true;
-              break;
-            }
-          }
+    // Function-wide peak register pressure, for before/after reporting
+    static minreg::Pressure peakPressure(Function &F) {
+      minreg::Liveness Live;
+      minreg::RegisterPressure RP;
+      Live.compute(F);
+      RP.compute(F, Live);
+      return RP.getMaxByClass();
+    }
+
+    bool run(Function &F, const TargetTransformInfo &TTIR, OptimizationRemarkEmitter &ORER) {
+      // Widths are tried by doubling from this one
+      if (!isPowerOf2_32(MinWidth))
+        report_fatal_error("-redwidth-min-width must be a power of two");
+      ORE = &ORER;
+      TTI = &TTIR;
+      DL = &F.getParent()->getDataLayout();
+      minreg::Pressure PeakBefore;
+      DEBUG(PeakBefore = peakPressure(F));
+
+      {
+        instr::PhaseTimer T("ranges", "reduce-width");
+        RA.compute(F);
+      }
+
+      {
+        instr::PhaseTimer T("webs", "reduce-width");
+        planWebs(F);
+      }
+
+      bool didSomething = !Planned.empty();
+      {
+        instr::PhaseTimer T("narrow", "reduce-width");
+        // Program order; each planned instruction is only erased by its
+        // own conversion
+        for (auto i = Planned.begin(), e = Planned.end(); i != e; ++i) {
+          const Choice &C = Plan.find(*i)->second;
+          convertInstruction(*i, C.Target, C.Signed);
         }
+        Plan.clear();
+        Planned.clear();
+      }
+
+      {
+        instr::PhaseTimer T("indices", "reduce-width");
+        didSomething |= foldIndexExtensions(F);
+        NewValues.clear();
       }
 
       DEBUG(dbgs() << "Downcasting complete, removing dead casts\n");
 
-      if(didSomething)
+      if(didSomething) {
+        instr::PhaseTimer T("cleanup", "reduce-width");
         removeDeadCasts(F);
+      }
+      RA.clear();
+
+      DEBUG(dbgs() << "Peak pressure before: "; PeakBefore.print(dbgs());
+            dbgs() << ", after: "; peakPressure(F).print(dbgs());
+            dbgs() << "\n");
 
       return didSomething;
     }
   };
 
-  struct PrintWidth : public FunctionPass {
+  struct ReduceWidth : public FunctionPass {
     static char ID;
-    PrintWidth() : FunctionPass(ID) {}
-
-    LazyValueInfo *LVI;
+    ReduceWidth() : FunctionPass(ID) {}
 
     void getAnalysisUsage(AnalysisUsage& AU) const override {
-      AU.addRequired<LazyValueInfoWrapperPass>();
+      AU.addRequired<TargetTransformInfoWrapperPass>();
+      AU.addRequired<OptimizationRemarkEmitterWrapperPass>();
+      // Instructions are replaced in place
+      AU.setPreservesCFG();
     }
 
     bool runOnFunction(Function &F) override {
-      LVI = &getAnalysis<LazyValueInfoWrapperPass>().getLVI();
-      for (auto bb = F.begin(), e = F.end(); bb != e; ++bb) {
-        errs() << "In " << bb->getName() << "\n";
-        for (auto i = bb->begin(), e = bb->end(); i != e; ++i) {
-          if(i->getType()->isIntegerTy()) {
-            ConstantRange cr = LVI->getConstantRange(&*i, &*bb, &*i);
-            unsigned minWidth;
-            if(cr.isFullSet()) {
-              minWidth = cr.getBitWidth();
-            } else {
-              for (minWidth=1; minWidth <= cr.getBitWidth(); minWidth++) {
-                APInt min, max;
-                if (cr.getLower().isNonNegative()) {
-                  max = APInt::getMaxValue(minWidth).zextOrSelf(cr.getBitWidth());
-                  if(cr.getUpper().ule(max)) {
-                    break;
-                  }
-                } else {
-                  min = APInt::getSignedMinValue(minWidth).sextOrSelf(cr.getBitWidth());
-                  max = APInt::getSignedMaxValue(minWidth).sextOrSelf(cr.getBitWidth());
-                  if(cr.getUpper().sle(max) && cr.getLower().sge(min)) {
-                    break;
-                  }
+      ReduceWidthImpl Impl;
+      return Impl.run(F, getAnalysis<TargetTransformInfoWrapperPass>().getTTI(F),
+                      getAnalysis<OptimizationRemarkEmitterWrapperPass>().getORE());
+    }
+  };
+
+  // Prints the range of every integer value and the width it fits in
+  void printWidths(Function &F) {
+    redwidth::RangeAnalysis RA;
+    RA.compute(F);
+    for (auto bb = F.begin(), e = F.end(); bb != e; ++bb) {
+      errs() << "In " << bb->getName() << "\n";
+      for (auto i = bb->begin(), e = bb->end(); i != e; ++i) {
+        if(i->getType()->isIntOrIntVectorTy()) {
+          ConstantRange cr = RA.getRange(&*i);
+          unsigned minWidth;
+          if(cr.isFullSet()) {
+            minWidth = cr.getBitWidth();
+          } else {
+            for (minWidth=1; minWidth <= cr.getBitWidth(); minWidth++) {
+              APInt min, max;
+              if (cr.getLower().isNonNegative()) {
+                max = APInt::getMaxValue(minWidth).zextOrSelf(cr.getBitWidth());
+                if(cr.getUpper().ule(max)) {
+                  break;
+                }
+              } else {
+                min = APInt::getSignedMinValue(minWidth).sextOrSelf(cr.getBitWidth());
+                max = APInt::getSignedMaxValue(minWidth).sextOrSelf(cr.getBitWidth());
+                if(cr.getUpper().sle(max) && cr.getLower().sge(min)) {
+                  break;
                 }
               }
             }
-            errs()  << "i" << minWidth << "\t" << cr << "\t= " << *i << "\n";
           }
+          errs()  << "i" << minWidth << "\t" << cr << "\t= " << *i << "\n";
         }
       }
+    }
+  }
+
+  struct PrintWidth : public FunctionPass {
+    static char ID;
+    PrintWidth() : FunctionPass(ID) {}
+
+    void getAnalysisUsage(AnalysisUsage& AU) const override {
+      AU.setPreservesAll();
+    }
+
+    bool runOnFunction(Function &F) override {
+      printWidths(F);
       return false;
     }
   };
 }
 
 char ReduceWidth::ID = 0;
+char PrintWidth::ID = 0;
 static RegisterPass<ReduceWidth> X("redwidth", "Reduce integers to the smallest bitwidth possible", false, false);
 static RegisterPass<PrintWidth> Y("pwidth", "Print ranges and widths for all values", false, false);
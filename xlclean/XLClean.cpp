@@ -0,0 +1,694 @@
+// xlclean: strips the '$' that the WCode translation leaves in names, in
+// bitcode files too big to load.
+//
+//   xlclean in.bc -o out.bc
+//
+// The bitcode is rewritten as a bitstream, and no IR is ever built. Only
+// names change, and they live in few places: global names in the string
+// table, and argument, block and instruction names in the symbol table of
+// each function. Those records are rewritten. Everything else is copied
+// bit for bit, and blocks with nothing to rewrite inside are copied whole.
+// The input is mapped rather than read, and the output is written out as
+// it is produced. Memory holds the global names, an offset per function
+// and the record at hand, however large the functions are.
+//
+// Clean global names are appended to the string table, and the records of
+// renamed globals point at them. As with xlcleanup, a global that is not
+// local keeps its '$' if its clean name is taken, and a local one gets a
+// numbered suffix. The function offsets in the module symbol table, and
+// the forward reference to that table, are moved by however much the
+// blocks before them shrank. The IR symbol table block repeats the global
+// names for linkers, so it is dropped; readers rebuild it when it is
+// missing.
+//
+// Block lengths are patched in place once each block ends, so output to a
+// pipe is buffered whole. Bitcode from before LLVM 5, which has no string
+// table, is left to opt -xlcleanup.
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitstreamReader.h"
+#include "llvm/Bitcode/LLVMBitCodes.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/PrettyStackTrace.h"
+#include "llvm/Support/Signals.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "common/Instrumentation.h"
+#include "minreg/XLCleanup.h"
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+
+#define DEBUG_TYPE "xlclean"
+
+STATISTIC(NumGlobalsRenamed, "Number of globals renamed");
+STATISTIC(NumValuesRenamed, "Number of arguments, blocks and instructions renamed");
+STATISTIC(NumGlobalsKept, "Number of globals not renamed because the name was taken");
+
+static cl::opt<std::string> InputFilename(cl::Positional,
+    cl::desc("<input bitcode file>"), cl::init("-"), cl::value_desc("filename"));
+
+static cl::opt<std::string> OutputFilename("o", cl::desc("Output filename"),
+    cl::init("-"), cl::value_desc("filename"));
+
+static Error error(const Twine &Msg) {
+  return make_error<StringError>(Msg, inconvertibleErrorCode());
+}
+
+namespace {
+  // Writes a bitstream a word at a time. A field written before its value
+  // is known, such as a block length, is watched: its bytes are saved as
+  // they are flushed, so that it can be patched in place later.
+  class BitWriter {
+    raw_pwrite_stream &OS;
+    std::vector<char> Buf;
+    uint64_t Flushed = 0;
+    uint64_t Cur = 0;
+    unsigned CurBits = 0;
+    unsigned Width = 2;
+
+    struct Block {
+      unsigned Width;
+      uint64_t LengthBit;
+    };
+    SmallVector<Block, 8> Blocks;
+
+    struct Field {
+      uint64_t Bit;
+      char Bytes[5];
+    };
+    SmallVector<Field, 8> Fields;
+
+    static const size_t FlushSize = 1 << 16;
+
+    void writeWord(uint32_t W) {
+      for (unsigned b = 0; b != 4; ++b)
+        Buf.push_back(char(W >> (8 * b)));
+      if (Buf.size() >= FlushSize)
+        flush();
+    }
+
+    void flush() {
+      for (auto f = Fields.begin(), e = Fields.end(); f != e; ++f)
+        for (unsigned k = 0; k != 5; ++k) {
+          uint64_t B = f->Bit / 8 + k;
+          if (B >= Flushed && B < Flushed + Buf.size())
+            f->Bytes[k] = Buf[B - Flushed];
+        }
+      OS.write(Buf.data(), Buf.size());
+      Flushed += Buf.size();
+      Buf.clear();
+    }
+
+  public:
+    explicit BitWriter(raw_pwrite_stream &OS) : OS(OS) {}
+
+    uint64_t getBitNo() const { return (Flushed + Buf.size()) * 8 + CurBits; }
+
+    // At most 32 bits
+    void emit(uint64_t Val, unsigned NumBits) {
+      Cur |= (Val & ((uint64_t(1) << NumBits) - 1)) << CurBits;
+      CurBits += NumBits;
+      if (CurBits >= 32) {
+        writeWord(uint32_t(Cur));
+        Cur >>= 32;
+        CurBits -= 32;
+      }
+    }
+
+    void emitVBR(uint64_t Val, unsigned NumBits) {
+      uint64_t Hi = uint64_t(1) << (NumBits - 1);
+      for (; Val >= Hi; Val >>= NumBits - 1)
+        emit((Val & (Hi - 1)) | Hi, NumBits);
+      emit(Val, NumBits);
+    }
+
+    void align() {
+      if (CurBits)
+        emit(0, 32 - CurBits);
+    }
+
+    // Whole words, at a word boundary. Long runs go straight to the stream.
+    void emitWords(const char *P, uint64_t NumBytes) {
+      assert(!CurBits && NumBytes % 4 == 0 && "Not whole words");
+      if (NumBytes < FlushSize) {
+        Buf.insert(Buf.end(), P, P + NumBytes);
+        if (Buf.size() >= FlushSize)
+          flush();
+        return;
+      }
+      flush();
+      OS.write(P, NumBytes);
+      Flushed += NumBytes;
+    }
+
+    // Bits [Begin, End) of Data, at any alignment
+    void copyBits(ArrayRef<uint8_t> Data, uint64_t Begin, uint64_t End) {
+      while (Begin < End) {
+        unsigned N = std::min<uint64_t>(32, End - Begin);
+        uint64_t V = 0;
+        for (uint64_t b = Begin / 8, e = (Begin + N + 7) / 8, s = 0; b != e; ++b, s += 8)
+          V |= uint64_t(Data[b]) << s;
+        emit(V >> (Begin % 8), N);
+        Begin += N;
+      }
+    }
+
+    // The 32 bits at BitNo, not written yet, will be patched
+    void watch(uint64_t BitNo) {
+      Field F = {BitNo, {0, 0, 0, 0, 0}};
+      Fields.push_back(F);
+    }
+
+    void patch(uint64_t BitNo, uint32_t Val) {
+      auto F = find_if(Fields, [&](const Field &f) { return f.Bit == BitNo; });
+      assert(F != Fields.end() && "Patching a field that is not watched");
+      assert(BitNo + 32 <= (Flushed + Buf.size()) * 8 && "Field not written yet");
+      uint64_t First = BitNo / 8, V = uint64_t(Val) << (BitNo % 8);
+      uint64_t M = uint64_t(0xffffffff) << (BitNo % 8);
+      unsigned NumBytes = (BitNo % 8 + 32 + 7) / 8, NumFlushed = 0;
+      for (unsigned k = 0; k != NumBytes; ++k) {
+        char *Byte = First + k < Flushed ? &F->Bytes[k] : &Buf[First + k - Flushed];
+        char Mask = char(M >> (8 * k));
+        *Byte = (*Byte & ~Mask) | (char(V >> (8 * k)) & Mask);
+        if (First + k < Flushed)
+          ++NumFlushed;
+      }
+      if (NumFlushed)
+        OS.pwrite(F->Bytes, NumFlushed, First);
+      Fields.erase(F);
+    }
+
+    void enterBlock(unsigned ID, unsigned NewWidth) {
+      emit(bitc::ENTER_SUBBLOCK, Width);
+      emitVBR(ID, bitc::BlockIDWidth);
+      emitVBR(NewWidth, bitc::CodeLenWidth);
+      align();
+      Block B = {Width, getBitNo()};
+      Blocks.push_back(B);
+      watch(B.LengthBit);
+      emit(0, bitc::BlockSizeWidth);
+      Width = NewWidth;
+    }
+
+    void exitBlock() {
+      emit(bitc::END_BLOCK, Width);
+      align();
+      Block B = Blocks.pop_back_val();
+      patch(B.LengthBit, (getBitNo() - B.LengthBit) / 32 - 1);
+      Width = B.Width;
+    }
+
+    // A block whose content, NumWords words at P, is copied as is
+    void copyBlock(unsigned ID, unsigned NewWidth, const char *P, uint32_t NumWords) {
+      emit(bitc::ENTER_SUBBLOCK, Width);
+      emitVBR(ID, bitc::BlockIDWidth);
+      emitVBR(NewWidth, bitc::CodeLenWidth);
+      align();
+      emit(NumWords, bitc::BlockSizeWidth);
+      emitWords(P, uint64_t(NumWords) * 4);
+    }
+
+    void emitRecord(unsigned Code, ArrayRef<uint64_t> Vals) {
+      emit(bitc::UNABBREV_RECORD, Width);
+      emitVBR(Code, 6);
+      emitVBR(Vals.size(), 6);
+      for (auto v = Vals.begin(), e = Vals.end(); v != e; ++v)
+        emitVBR(*v, 6);
+    }
+
+    // The only record of a block: Code followed by a blob
+    void emitBlobRecord(unsigned Code, ArrayRef<StringRef> Parts) {
+      // DEFINE_ABBREV [literal Code, blob]
+      emit(bitc::DEFINE_ABBREV, Width);
+      emitVBR(2, 5);
+      emit(1, 1);
+      emitVBR(Code, 8);
+      emit(0, 1);
+      emit(BitCodeAbbrevOp::Blob, 3);
+
+      uint64_t Size = 0;
+      for (auto p = Parts.begin(), e = Parts.end(); p != e; ++p)
+        Size += p->size();
+      emit(bitc::FIRST_APPLICATION_ABBREV, Width);
+      emitVBR(Size, 6);
+      align();
+      for (auto p = Parts.begin(), e = Parts.end(); p != e; ++p)
+        for (auto c = p->begin(), ce = p->end(); c != ce; ++c)
+          emit(uint8_t(*c), 8);
+      align();
+    }
+
+    void finish() {
+      assert(Blocks.empty() && Fields.empty() && "Unfinished blocks");
+      align();
+      flush();
+    }
+  };
+
+  // Rewrites the names in one bitcode file, in two passes. The first finds
+  // the globals and the string table and picks the new global names; the
+  // second copies the stream, rewriting the records that hold names or
+  // offsets.
+  class Rewriter {
+    ArrayRef<uint8_t> Data;
+    BitstreamCursor In;
+    BitWriter &Out;
+    Optional<BitstreamBlockInfo> BlockInfo;
+
+    // A global's name in the string table, in record order
+    struct Global {
+      uint64_t Offset, Size;
+      bool Local, Renamed;
+    };
+    std::vector<Global> Globals;
+    StringRef Strtab;
+    std::string Appended;
+    // Offsets in the module are in words from one word before this one
+    uint64_t StartWord = 0;
+    bool HaveStart = false;
+
+    unsigned NextGlobal = 0;
+    // Word of each function block, before and after
+    DenseMap<uint64_t, uint64_t> FunctionWords;
+    uint64_t VSTOffset = 0, VSTOffsetBit = 0;
+    bool HaveVSTOffset = false;
+
+    static bool isGlobalRecord(unsigned Code) {
+      return Code == bitc::MODULE_CODE_GLOBALVAR || Code == bitc::MODULE_CODE_FUNCTION ||
+             Code == bitc::MODULE_CODE_ALIAS || Code == bitc::MODULE_CODE_IFUNC;
+    }
+
+    // Internal, private, and the old linker_private kinds
+    static bool isLocalLinkage(uint64_t Linkage) {
+      return Linkage == 3 || Linkage == 9 || Linkage == 13 || Linkage == 14;
+    }
+
+    Error readBlockInfo() {
+      BlockInfo = In.ReadBlockInfoBlock();
+      if (!BlockInfo)
+        return error("malformed block info block");
+      In.setBlockInfo(BlockInfo.getPointer());
+      return Error::success();
+    }
+
+    Error scanModule() {
+      if (In.EnterSubBlock(bitc::MODULE_BLOCK_ID))
+        return error("malformed module block");
+      SmallVector<uint64_t, 64> Vals;
+      while (true) {
+        BitstreamEntry E = In.advance();
+        switch (E.Kind) {
+        case BitstreamEntry::Error:
+          return error("malformed module block");
+        case BitstreamEntry::EndBlock:
+          return Error::success();
+        case BitstreamEntry::SubBlock:
+          if (E.ID == bitc::BLOCKINFO_BLOCK_ID) {
+            if (Error Err = readBlockInfo())
+              return Err;
+          } else if (In.SkipBlock()) {
+            return error("malformed block");
+          }
+          continue;
+        case BitstreamEntry::Record:
+          break;
+        }
+        Vals.clear();
+        unsigned Code = In.readRecord(E.ID, Vals);
+        if (Code == bitc::MODULE_CODE_VERSION && (Vals.empty() || Vals[0] < 2))
+          return error("bitcode without a string table, from before LLVM 5; use opt -xlcleanup");
+        if (isGlobalRecord(Code)) {
+          if (Vals.size() < 6)
+            return error("malformed global record");
+          Global G = {Vals[0], Vals[1], isLocalLinkage(Vals[5]), false};
+          Globals.push_back(G);
+        }
+      }
+    }
+
+    Error readStrtab() {
+      if (In.EnterSubBlock(bitc::STRTAB_BLOCK_ID))
+        return error("malformed string table");
+      SmallVector<uint64_t, 1> Vals;
+      while (true) {
+        BitstreamEntry E = In.advance();
+        switch (E.Kind) {
+        case BitstreamEntry::Error:
+          return error("malformed string table");
+        case BitstreamEntry::EndBlock:
+          return Error::success();
+        case BitstreamEntry::SubBlock:
+          if (In.SkipBlock())
+            return error("malformed string table");
+          continue;
+        case BitstreamEntry::Record:
+          break;
+        }
+        StringRef Blob;
+        Vals.clear();
+        if (In.readRecord(E.ID, Vals, &Blob) == bitc::STRTAB_BLOB)
+          Strtab = Blob;
+      }
+    }
+
+    // A global that is not local keeps its name if the clean one is taken.
+    // A local one gets a suffix instead, as setName would give it; the
+    // reader would otherwise rename whichever global came second.
+    Error pickNames() {
+      StringSet<> Taken;
+      for (auto g = Globals.begin(), e = Globals.end(); g != e; ++g) {
+        if (g->Offset + g->Size > Strtab.size())
+          return error("global name outside the string table");
+        Taken.insert(Strtab.substr(g->Offset, g->Size));
+      }
+      SmallString<128> Clean;
+      unsigned LastUnique = 0;
+      for (auto g = Globals.begin(), e = Globals.end(); g != e; ++g) {
+        StringRef Name = Strtab.substr(g->Offset, g->Size);
+        if (!minreg::getCleanName(Name, Clean))
+          continue;
+        if (!Clean.empty() && Taken.count(Clean)) {
+          if (!g->Local) {
+            DEBUG(dbgs() << "Global kept: " << Name << ", " << Clean << " is taken\n");
+            ++NumGlobalsKept;
+            continue;
+          }
+          size_t BaseSize = Clean.size();
+          do {
+            Clean.resize(BaseSize);
+            raw_svector_ostream(Clean) << "." << ++LastUnique;
+          } while (Taken.count(Clean));
+        } else if (Clean.empty() && !g->Local) {
+          DEBUG(dbgs() << "Global kept: " << Name << ", nothing left\n");
+          ++NumGlobalsKept;
+          continue;
+        }
+        DEBUG(dbgs() << "Global rename: " << Name << " -> " << Clean << "\n");
+        Taken.insert(Clean);
+        g->Offset = Strtab.size() + Appended.size();
+        g->Size = Clean.size();
+        g->Renamed = true;
+        Appended += Clean;
+        ++NumGlobalsRenamed;
+      }
+      return Error::success();
+    }
+
+    Error scanTopBlock(unsigned ID, uint64_t Pos, bool &SeenModule) {
+      switch (ID) {
+      case bitc::BLOCKINFO_BLOCK_ID:
+        return readBlockInfo();
+      case bitc::IDENTIFICATION_BLOCK_ID:
+      case bitc::MODULE_BLOCK_ID:
+        if (!HaveStart) {
+          StartWord = Pos / 32;
+          HaveStart = true;
+        }
+        if (ID == bitc::IDENTIFICATION_BLOCK_ID)
+          return In.SkipBlock() ? error("malformed identification block") : Error::success();
+        if (SeenModule)
+          return error("more than one module");
+        SeenModule = true;
+        return scanModule();
+      case bitc::STRTAB_BLOCK_ID:
+        return readStrtab();
+      default:
+        return In.SkipBlock() ? error("malformed block") : Error::success();
+      }
+    }
+
+    Error scan() {
+      In.JumpToBit(32);
+      bool SeenModule = false;
+      while (!In.AtEndOfStream()) {
+        uint64_t Pos = In.GetCurrentBitNo();
+        BitstreamEntry E = In.advance();
+        // Anything after the last block is padding
+        if (E.Kind != BitstreamEntry::SubBlock)
+          break;
+        if (Error Err = scanTopBlock(E.ID, Pos, SeenModule))
+          return Err;
+      }
+      if (!SeenModule)
+        return error("no module");
+      return pickNames();
+    }
+
+    // Copies the block just entered without looking inside
+    Error copyBlock(unsigned ID) {
+      unsigned Width = In.ReadVBR(bitc::CodeLenWidth);
+      In.JumpToBit(alignTo(In.GetCurrentBitNo(), 32));
+      uint32_t NumWords = In.Read(bitc::BlockSizeWidth);
+      uint64_t Begin = In.GetCurrentBitNo();
+      if (Begin / 8 + uint64_t(NumWords) * 4 > Data.size())
+        return error("truncated block");
+      Out.copyBlock(ID, Width, reinterpret_cast<const char *>(Data.data()) + Begin / 8, NumWords);
+      In.JumpToBit(Begin + uint64_t(NumWords) * 32);
+      return Error::success();
+    }
+
+    // Later blocks need the abbreviations, so the cursor reads it too
+    Error copyBlockInfo() {
+      uint64_t Pos = In.GetCurrentBitNo();
+      if (Error Err = copyBlock(bitc::BLOCKINFO_BLOCK_ID))
+        return Err;
+      In.JumpToBit(Pos);
+      return readBlockInfo();
+    }
+
+    static bool hasNames(unsigned Parent, unsigned ID) {
+      return (Parent == bitc::MODULE_BLOCK_ID &&
+              (ID == bitc::FUNCTION_BLOCK_ID || ID == bitc::VALUE_SYMTAB_BLOCK_ID)) ||
+             (Parent == bitc::FUNCTION_BLOCK_ID && ID == bitc::VALUE_SYMTAB_BLOCK_ID);
+    }
+
+    // Copies one record, or writes its new version, or drops it
+    Error rewriteRecord(unsigned BlockID, unsigned AbbrevID, unsigned Code,
+                        SmallVectorImpl<uint64_t> &Vals, uint64_t Begin, uint64_t End) {
+      if (BlockID == bitc::MODULE_BLOCK_ID) {
+        // A hash of the old bytes
+        if (Code == bitc::MODULE_CODE_HASH)
+          return Error::success();
+        if (Code == bitc::MODULE_CODE_VSTOFFSET) {
+          // A 32-bit placeholder ending the record, patched by the writer
+          const BitCodeAbbrev *Abbv =
+              AbbrevID >= bitc::FIRST_APPLICATION_ABBREV ? In.getAbbrev(AbbrevID) : nullptr;
+          const BitCodeAbbrevOp *Last =
+              Abbv ? &Abbv->getOperandInfo(Abbv->getNumOperandInfos() - 1) : nullptr;
+          if (Vals.size() != 1 || !Last || Last->isLiteral() ||
+              Last->getEncoding() != BitCodeAbbrevOp::Fixed || Last->getEncodingData() != 32)
+            return error("unexpected symbol table offset record");
+          VSTOffset = Vals[0];
+          VSTOffsetBit = Out.getBitNo() + (End - Begin) - 32;
+          HaveVSTOffset = true;
+          Out.watch(VSTOffsetBit);
+        } else if (isGlobalRecord(Code)) {
+          const Global &G = Globals[NextGlobal++];
+          if (G.Renamed) {
+            Vals[0] = G.Offset;
+            Vals[1] = G.Size;
+            Out.emitRecord(Code, Vals);
+            return Error::success();
+          }
+        }
+      } else if (BlockID == bitc::VALUE_SYMTAB_BLOCK_ID) {
+        if (Code == bitc::VST_CODE_FNENTRY) {
+          auto W = Vals.size() >= 2 ? FunctionWords.find(Vals[1] - 1 + StartWord)
+                                    : FunctionWords.end();
+          if (W == FunctionWords.end())
+            return error("function offset that is not a function block");
+          Vals[1] = W->second - StartWord + 1;
+          Out.emitRecord(Code, Vals);
+          return Error::success();
+        }
+        if ((Code == bitc::VST_CODE_ENTRY || Code == bitc::VST_CODE_BBENTRY) && Vals.size() > 1) {
+          auto Name = std::remove(Vals.begin() + 1, Vals.end(), uint64_t('$'));
+          if (Name != Vals.end()) {
+            ++NumValuesRenamed;
+            // With nothing left, the value is unnamed
+            if (Name != Vals.begin() + 1) {
+              Vals.erase(Name, Vals.end());
+              Out.emitRecord(Code, Vals);
+            }
+            return Error::success();
+          }
+        }
+      }
+      Out.copyBits(Data, Begin, End);
+      return Error::success();
+    }
+
+    // Copies a block that holds names, looking at every record. Pos is
+    // where the block started.
+    Error rewriteBlock(unsigned ID, unsigned Parent, uint64_t Pos) {
+      if (Parent == bitc::MODULE_BLOCK_ID) {
+        // The module points at these blocks by word
+        if (Pos % 32 || Out.getBitNo() % 32)
+          return error("function or symbol table block not word aligned");
+        uint64_t Old = Pos / 32, New = Out.getBitNo() / 32;
+        if (ID == bitc::FUNCTION_BLOCK_ID) {
+          FunctionWords[Old] = New;
+        } else if (HaveVSTOffset) {
+          if (VSTOffset - 1 + StartWord != Old)
+            return error("symbol table offset that is not the symbol table");
+          Out.patch(VSTOffsetBit, New - StartWord + 1);
+          HaveVSTOffset = false;
+        }
+      }
+
+      if (In.EnterSubBlock(ID))
+        return error("malformed block");
+      Out.enterBlock(ID, In.getAbbrevIDWidth());
+      SmallVector<uint64_t, 64> Vals;
+      while (true) {
+        uint64_t Begin = In.GetCurrentBitNo();
+        BitstreamEntry E = In.advance(BitstreamCursor::AF_DontAutoprocessAbbrevs);
+        switch (E.Kind) {
+        case BitstreamEntry::Error:
+          return error("malformed block");
+        case BitstreamEntry::EndBlock:
+          if (ID == bitc::MODULE_BLOCK_ID && HaveVSTOffset)
+            return error("symbol table offset with no symbol table");
+          Out.exitBlock();
+          return Error::success();
+        case BitstreamEntry::SubBlock: {
+          Error Err = E.ID == bitc::BLOCKINFO_BLOCK_ID ? copyBlockInfo()
+                      : hasNames(ID, E.ID)             ? rewriteBlock(E.ID, ID, Begin)
+                                                       : copyBlock(E.ID);
+          if (Err)
+            return Err;
+          continue;
+        }
+        case BitstreamEntry::Record:
+          break;
+        }
+        if (E.ID == bitc::DEFINE_ABBREV) {
+          In.ReadAbbrevRecord();
+          Out.copyBits(Data, Begin, In.GetCurrentBitNo());
+          continue;
+        }
+        Vals.clear();
+        unsigned Code = In.readRecord(E.ID, Vals);
+        if (Error Err = rewriteRecord(ID, E.ID, Code, Vals, Begin, In.GetCurrentBitNo()))
+          return Err;
+      }
+    }
+
+    Error rewriteTopBlock(unsigned ID, uint64_t Pos) {
+      // Offsets in the module count from here, in both files
+      if ((ID == bitc::IDENTIFICATION_BLOCK_ID || ID == bitc::MODULE_BLOCK_ID) &&
+          Out.getBitNo() != Pos)
+        return error("start of the module moved");
+      switch (ID) {
+      case bitc::BLOCKINFO_BLOCK_ID:
+        return copyBlockInfo();
+      case bitc::MODULE_BLOCK_ID:
+        return rewriteBlock(ID, ~0U, Pos);
+      case bitc::STRTAB_BLOCK_ID:
+        if (In.SkipBlock())
+          return error("malformed string table");
+        Out.enterBlock(bitc::STRTAB_BLOCK_ID, 3);
+        Out.emitBlobRecord(bitc::STRTAB_BLOB, {Strtab, Appended});
+        Out.exitBlock();
+        return Error::success();
+      case bitc::SYMTAB_BLOCK_ID:
+        return In.SkipBlock() ? error("malformed symbol table") : Error::success();
+      default:
+        return copyBlock(ID);
+      }
+    }
+
+    Error rewrite() {
+      In.JumpToBit(32);
+      Out.copyBits(Data, 0, 32);
+      while (!In.AtEndOfStream()) {
+        uint64_t Pos = In.GetCurrentBitNo();
+        BitstreamEntry E = In.advance(BitstreamCursor::AF_DontAutoprocessAbbrevs);
+        if (E.Kind != BitstreamEntry::SubBlock)
+          break;
+        if (Error Err = rewriteTopBlock(E.ID, Pos))
+          return Err;
+      }
+      Out.finish();
+      return Error::success();
+    }
+
+  public:
+    Rewriter(ArrayRef<uint8_t> Data, BitWriter &Out) : Data(Data), In(Data), Out(Out) {}
+
+    Error run() {
+      if (Error Err = scan())
+        return Err;
+      return rewrite();
+    }
+  };
+}
+
+int main(int argc, char **argv) {
+  sys::PrintStackTraceOnErrorSignal(argv[0]);
+  PrettyStackTraceProgram X(argc, argv);
+  llvm_shutdown_obj Y;
+
+  cl::ParseCommandLineOptions(argc, argv, "streaming WCode name cleanup\n");
+
+  ErrorOr<std::unique_ptr<MemoryBuffer>> Buffer =
+      MemoryBuffer::getFileOrSTDIN(InputFilename, -1, /*RequiresNullTerminator=*/false);
+  if (!Buffer) {
+    errs() << argv[0] << ": " << InputFilename << ": " << Buffer.getError().message() << "\n";
+    return 1;
+  }
+  const unsigned char *Begin = reinterpret_cast<const unsigned char *>((*Buffer)->getBufferStart());
+  const unsigned char *End = reinterpret_cast<const unsigned char *>((*Buffer)->getBufferEnd());
+  if (isBitcodeWrapper(Begin, End) && SkipBitcodeWrapperHeader(Begin, End, true)) {
+    errs() << argv[0] << ": " << InputFilename << ": invalid bitcode wrapper\n";
+    return 1;
+  }
+  if (!isRawBitcode(Begin, End)) {
+    errs() << argv[0] << ": " << InputFilename << " is not bitcode; use opt -xlcleanup\n";
+    return 1;
+  }
+
+  std::error_code EC;
+  std::unique_ptr<tool_output_file> Out(new tool_output_file(OutputFilename, EC, sys::fs::F_None));
+  if (EC) {
+    errs() << argv[0] << ": " << EC.message() << "\n";
+    return 1;
+  }
+
+  // Patching needs a stream that can seek
+  SmallVector<char, 0> Whole;
+  raw_svector_ostream WholeOS(Whole);
+  bool Seekable = Out->os().supportsSeeking();
+  {
+    instr::PhaseTimer T("rewrite", "xlclean");
+    BitWriter W(Seekable ? static_cast<raw_pwrite_stream &>(Out->os()) : WholeOS);
+    Rewriter R(makeArrayRef(Begin, End), W);
+    if (Error E = R.run()) {
+      logAllUnhandledErrors(std::move(E), errs(), Twine(argv[0]) + ": ");
+      return 1;
+    }
+  }
+  if (!Seekable)
+    Out->os() << WholeOS.str();
+  Out->keep();
+  return 0;
+}